@@ -6,144 +6,318 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h> // isspace
+#include <errno.h>
+#include <unistd.h> // getopt
+#include <fcntl.h> // fallocate
+#include <sys/stat.h>
 
 #ifdef SYS
-#include <fcntl.h>
-#include <unistd.h>
 #define PROGNAME "main-sys"
-#define WRITE(buf, nbytes) do {\
-        ssize_t total = 0; \
-        while (total < (nbytes)) { \
-            ssize_t written = write(fdout, (buf) + total, (nbytes) - total); \
-            if (written == -1) { \
-                perror("Write failed"); \
-                exit(1); \
-            } \
-            total += written; \
-        } \
-    } while (0)
 #else
 #define PROGNAME "main-lib"
-#define WRITE(buf, nbytes) do {\
-        ssize_t written = fwrite((buf), 1, (nbytes), ofile); \
-        if (written < (nbytes)) { /* Can't reliably distinguish errors here */ \
-            perror("Write failed"); \
-            exit(1); \
-        } \
-    } while (0)
 #endif
 
+#define BUFSIZE 65536
+#define BUFSIZE_INPLACE (4 << 20)
+#define COLLAPSE_MIN (1 << 20) // smallest dead range worth cutting out with fallocate()
+
+// Line transforms, all applied in the same pass
+enum {
+    F_DROPBLANK = 1 << 0, // -d: drop lines consisting only of whitespace
+    F_TRIM      = 1 << 1, // -t: strip trailing whitespace
+    F_SQUEEZE   = 1 << 2, // -s: squeeze runs of blank lines into one
+    F_CRLF      = 1 << 3, // -c: convert CRLF line endings to LF
+};
+
+static unsigned flags;
+static bool content = false;   // current line has seen a non-whitespace character
+static bool prevblank = false; // last line written out was blank
+
+// In-place mode (-i): kept data slides down within the file, the write cursor never passes the read cursor
+static bool inplace = false;
+static int fdio;
+static off_t roff, woff;  // read and write cursors
+static off_t bufoff;      // current file offset of inbuf[0]
+static off_t fsize;
+static const char *inbuf;
+static blksize_t blksize; // 0 if FALLOC_FL_COLLAPSE_RANGE is not usable
+static char *tailbuf;
+
+#ifdef SYS
+static int fdin, fdout;
+
+static ssize_t readbuf_stream(char *buf, size_t nbytes) {
+    ssize_t nread = read(fdin, buf, nbytes);
+    if (nread == -1) {
+        perror("Failed to read from file");
+        exit(1);
+    }
+    return nread;
+}
+
+static void emit_stream(const char *buf, size_t nbytes) {
+    size_t total = 0;
+    while (total < nbytes) {
+        ssize_t written = write(fdout, buf + total, nbytes - total);
+        if (written == -1) {
+            perror("Write failed");
+            exit(1);
+        }
+        total += written;
+    }
+}
+#else
+static FILE *ifile, *ofile;
+
+static ssize_t readbuf_stream(char *buf, size_t nbytes) {
+    ssize_t nread = (ssize_t) fread(buf, 1, nbytes, ifile);
+    if (nread == 0 && ferror(ifile) != 0) {
+        perror("Failed to read from file");
+        exit(1);
+    }
+    return nread;
+}
+
+static void emit_stream(const char *buf, size_t nbytes) {
+    if (nbytes == 0) return;
+    if (fwrite(buf, 1, nbytes, ofile) < nbytes) { // Can't reliably distinguish errors here
+        perror("Write failed");
+        exit(1);
+    }
+}
+#endif
+
+static void pwriteall(const char *buf, size_t nbytes, off_t off) {
+    size_t total = 0;
+    while (total < nbytes) {
+        ssize_t written = pwrite(fdio, buf + total, nbytes - total, off + total);
+        if (written == -1) {
+            perror("Write failed");
+            exit(1);
+        }
+        total += written;
+    }
+}
+
+static ssize_t readbuf_inplace(char *buf, size_t nbytes) {
+    ssize_t nread = pread(fdio, buf, nbytes, roff);
+    if (nread == -1) {
+        perror("Failed to read from file");
+        exit(1);
+    }
+    roff += nread;
+    return nread;
+}
+
+static void emit_inplace(const char *buf, size_t nbytes) {
+    // Until something gets dropped the data is already where it belongs, don't rewrite it
+    if (bufoff + (buf - inbuf) != woff)
+        pwriteall(buf, nbytes, woff);
+    woff += nbytes;
+}
+
+static ssize_t readbuf(char *buf, size_t nbytes) {
+    return inplace ? readbuf_inplace(buf, nbytes) : readbuf_stream(buf, nbytes);
+}
+
+static void emit(const char *buf, size_t nbytes) {
+    if (inplace) emit_inplace(buf, nbytes);
+    else emit_stream(buf, nbytes);
+}
+
+// Called after a dropped range, buf points past its end. Everything between the write cursor and buf is dead.
+// If that is a whole number of blocks, cut it out of the file, so the following data lands exactly in place
+// and doesn't need to be rewritten. The partial block in front of the write cursor is saved and restored.
+static void dropped(const char *buf) {
+    if (!inplace || blksize == 0) return;
+    off_t end = bufoff + (buf - inbuf);
+    off_t len = end - woff;
+    if (len < COLLAPSE_MIN || len % blksize != 0 || end >= fsize) return;
+    off_t start = woff - woff % blksize;
+    size_t keep = woff - start;
+    if (pread(fdio, tailbuf, keep, start) != (ssize_t) keep) {
+        perror("Failed to read from file");
+        exit(1);
+    }
+    if (fallocate(fdio, FALLOC_FL_COLLAPSE_RANGE, start, len) == -1) {
+        if (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS) {
+            blksize = 0; // Not supported here, keep sliding data down
+            return;
+        }
+        perror("Failed to collapse file range");
+        exit(1);
+    }
+    pwriteall(tailbuf, keep, start);
+    roff -= len;
+    bufoff -= len;
+    fsize -= len;
+}
+
+// Runs all selected transforms over buf[0..nbuf) at once, writing kept bytes directly from buf.
+// Kept bytes are batched, so one write covers everything between two dropped ranges.
+// Returns the start of the undecided tail - whitespace that may still get trimmed or dropped
+// depending on what follows - which the caller has to pass again in front of the next chunk.
+// At EOF everything is decided and nbuf is returned.
+static size_t filter(const char *buf, size_t nbuf, bool eof) {
+    size_t out = 0; // [out, ws) is kept, waiting to be written
+    size_t ws = 0;  // [ws, i) is pending whitespace
+#define DROP(from, to) do { emit(buf + out, (from) - out); out = (to); dropped(buf + out); } while (0)
+    for (size_t i = 0; i < nbuf; i++) {
+        if (content && !(flags & (F_TRIM | F_CRLF))) {
+            // Nothing can be removed from the rest of this line, skip straight to its end
+            const char *eol = memchr(buf + i, '\n', nbuf - i);
+            if (eol == NULL) {
+                ws = nbuf;
+                break;
+            }
+            i = eol - buf;
+        }
+        unsigned char c = buf[i];
+        if (c == '\n') {
+            bool blank = !content;
+            if (blank && ((flags & F_DROPBLANK) || ((flags & F_SQUEEZE) && prevblank))) {
+                DROP(ws, i + 1);
+            } else {
+                if (flags & F_TRIM) {
+                    DROP(ws, i);
+                } else if ((flags & F_CRLF) && i > ws && buf[i - 1] == '\r') {
+                    DROP(i - 1, i);
+                }
+                prevblank = blank;
+            }
+            content = false;
+            ws = i + 1;
+        } else if (!isspace(c)) {
+            content = true;
+            ws = i + 1;
+        }
+    }
+    if (eof) {
+        // Last line has no newline, there is no line ending to convert
+        bool blank = !content;
+        if (!(flags & F_TRIM) && !(blank && ((flags & F_DROPBLANK) || ((flags & F_SQUEEZE) && prevblank))))
+            ws = nbuf;
+        emit(buf + out, ws - out);
+        return nbuf;
+    }
+#undef DROP
+    emit(buf + out, ws - out);
+    return ws;
+}
+
 int main(int argc, char** argv) {
-    if (argc != 3) {
-        printf("Usage: %s <input file> <output file>\n", argc > 0 ? argv[0] : PROGNAME);
+    int opt;
+    while ((opt = getopt(argc, argv, "idtsc")) != -1) {
+        switch (opt) {
+            case 'i': inplace = true; break;
+            case 'd': flags |= F_DROPBLANK; break;
+            case 't': flags |= F_TRIM; break;
+            case 's': flags |= F_SQUEEZE; break;
+            case 'c': flags |= F_CRLF; break;
+            default: argc = 0; break; // print usage
+        }
+    }
+    if (argc - optind != (inplace ? 1 : 2)) {
+        printf("Usage: %s [-d] [-t] [-s] [-c] <input file> <output file>\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("       %s -i [-d] [-t] [-s] [-c] <file>\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("  -i  filter the file in place, without making a copy\n");
+        printf("  -d  drop blank (whitespace-only) lines, the default if no flags are given\n");
+        printf("  -t  trim trailing whitespace\n");
+        printf("  -s  squeeze runs of blank lines into one\n");
+        printf("  -c  convert CRLF line endings to LF\n");
         exit(2);
     }
+    if (flags == 0) flags = F_DROPBLANK;
+    size_t cap = BUFSIZE, carry = 0;
+    const char *inpath = argv[optind], *outpath = argv[optind + 1];
+    if (inplace) {
+        // Always done with syscalls, stdio has no way to read and write at different offsets
+        fdio = open(inpath, O_RDWR);
+        if (fdio == -1) {
+            perror("Failed to open file");
+            exit(1);
+        }
+        struct stat sb;
+        if (fstat(fdio, &sb) == -1) {
+            perror("Failed to stat file");
+            exit(1);
+        }
+        fsize = sb.st_size;
+        blksize = S_ISREG(sb.st_mode) ? sb.st_blksize : 0;
+        tailbuf = blksize > 0 ? malloc(blksize) : NULL;
+        if (blksize > 0 && tailbuf == NULL) {
+            perror("Failed to allocate buffer");
+            exit(1);
+        }
+        cap = BUFSIZE_INPLACE;
+        goto opened;
+    }
 #ifdef SYS
-    int fdin = open(argv[1], O_RDONLY);
+    fdin = open(inpath, O_RDONLY);
     if (fdin == -1) {
         perror("Failed to open input file");
         exit(1);
     }
-    int fdout = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    fdout = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
     if (fdout == -1) {
         perror("Failed to open output file");
         exit(1);
     }
 #else
-    FILE *ifile = fopen(argv[1], "r");
+    ifile = fopen(inpath, "r");
     if (ifile == NULL) {
         perror("Failed to open file");
         exit(1);
     }
-    FILE *ofile = fopen(argv[2], "w");
+    ofile = fopen(outpath, "w");
     if (ofile == NULL) {
         perror("Failed to open file");
         exit(1);
     }
 #endif
 
-    off_t curseekoff = 0, lineseekoff = 0;
-    int curpos = 0, linepos = 0;
-    ssize_t nbuf = 0;
-    char buf[4096];
-
-    bool writing = false;
-    bool postseek = false;
+opened:;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        perror("Failed to allocate buffer");
+        exit(1);
+    }
 
+    ssize_t nbuf;
     do {
-read:
-#ifdef SYS
-        nbuf = read(fdin, buf, sizeof(buf));
-        if (nbuf == -1) {
-            perror("Failed to read from file");
-            exit(1);
+        if (carry == cap) {
+            // Whitespace run longer than the whole buffer, rare enough to just grow it
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) {
+                perror("Failed to allocate buffer");
+                exit(1);
+            }
         }
-#else
-        curseekoff = ftell(ifile);
-        nbuf = (ssize_t) fread(buf, 1, sizeof(buf), ifile);
-        if (nbuf == 0 && ferror(ifile) != 0) {
-            perror("Failed to read from file");
+        inbuf = buf;
+        bufoff = roff - carry;
+        nbuf = readbuf(buf + carry, cap - carry);
+        size_t len = carry + nbuf;
+        size_t done = filter(buf, len, nbuf == 0);
+        carry = len - done;
+        memmove(buf, buf + done, carry);
+    } while (nbuf > 0);
+
+    free(buf);
+    if (inplace) {
+        if (ftruncate(fdio, woff) == -1) {
+            perror("Failed to truncate file");
             exit(1);
         }
+        free(tailbuf);
+        return 0;
+    }
+#ifndef SYS
+    if (fclose(ofile) != 0) {
+        perror("Write failed");
+        exit(1);
+    }
 #endif
-        if (postseek) {
-            curpos = linepos;
-            curseekoff = lineseekoff;
-        } else {
-            curpos = 0;
-        }
-        postseek = false;
-        // High level overview:
-        // Scanning mode:
-        //   When you see a newline, remember where it started (seek offset + buffer offset)
-        //   When you see a space character, consume it, ignore it
-        //   When you see a nonspace character, go to start of line, go into writing mode.
-        // Writing mode:
-        //   Write everything up to a newline.
-        //   Then record location of line start, go to scanning mode.
-        while (curpos < nbuf) {
-            if (writing) {
-                char *eol = (char*)memchr(buf + curpos, '\n', nbuf - curpos);
-                if (eol == NULL) {
-                    WRITE(buf + curpos, nbuf - curpos);
-                    curpos = nbuf;
-                } else {
-                    WRITE(buf + curpos, eol - (buf + curpos) + 1);
-                    curpos = eol - buf + 1;
-                    lineseekoff = curseekoff;
-                    linepos = curpos; // one past newline
-                    writing = false;
-                }
-            } else {
-                if (buf[curpos] == '\n') {
-                    // Haven't seen non-space character
-                    lineseekoff = curseekoff;
-                    linepos = ++curpos;
-                } else if (!isspace(buf[curpos])) {
-                    if (curseekoff != lineseekoff) {
-#ifdef SYS
-                        lseek(fdin, lineseekoff, SEEK_SET);
-#else
-                        fseek(ifile, lineseekoff, SEEK_SET);
-#endif
-                        curseekoff = lineseekoff;
-                        writing = true;
-                        postseek = true;
-                        goto read;
-                    } else {
-                        curpos = linepos;
-                        writing = true;
-                        continue;
-                    }
-                } else {
-                    curpos++;
-                }
-            }
-        }
-#ifdef SYS
-        curseekoff += nbuf; // no ftell() equivalent, needs tracking bytes manually
-#endif
-    } while (nbuf > 0);
 
     return 0;
 }
@@ -4,13 +4,50 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h> // getopt
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#ifndef BUFSIZE
+#define BUFSIZE 65536
+#endif
+#define MAX_SCANS 16
+#define MMAP_MIN (1 << 20) // in auto mode, files at least this big get mmap()ed instead of read()
+#define DIRECT_ALIGN 4096
+#define BENCH_RUNS 3
+#define PIECE_MIN (16 << 20)  // -p: smallest range of a file counted on its own
+#define PIECE_ALIGN (1 << 20) // -p: ranges start at multiples of this, as O_DIRECT and mmap need aligned offsets
+#define INDEX_SUFFIX ".nlidx"
+#define INDEX_INTERVAL 1024   // newlines between index checkpoints
+
+// I/O strategies, selected with -I
+enum backend {
+    IO_AUTO,    // mmap for big regular files, read otherwise
+    IO_READ,    // read() into the buffer
+    IO_STDIO,   // fread() into the buffer
+    IO_MMAP,    // map the whole file
+    IO_DIRECT,  // read() with O_DIRECT, bypassing the page cache
+    IO_FADVISE, // read() after posix_fadvise() SEQUENTIAL and WILLNEED
+    IO_COUNT
+};
+
+static const char *backend_names[IO_COUNT] = { "auto", "read", "stdio", "mmap", "direct", "fadvise" };
 
 #ifdef SYS
-#include <fcntl.h>
-#include <unistd.h>
 #define PROGNAME "main-sys"
+#define DEFAULT_BACKEND IO_AUTO
 #else
 #define PROGNAME "main-lib"
+#define DEFAULT_BACKEND IO_STDIO
 #endif
 
 static int interpret_char(char* str) {
@@ -49,60 +86,991 @@ static int interpret_char(char* str) {
 #undef RETC
 }
 
-int main(int argc, char** argv) {
-    int chr;
-    if (argc != 3 || (chr = interpret_char(argv[1])) == -1) {
-        printf("Usage: %s <character> <file>\n", argc > 0 ? argv[0] : PROGNAME);
-        exit(2);
+struct counter {
+    uint64_t matchlines, matchbytes;
+    bool freshline;
+    char chr;
+};
+
+static void count_scalar(struct counter *c, const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == c->chr) {
+            c->matchbytes++;
+            if (c->freshline) c->matchlines++;
+            c->freshline = false;
+        }
+        if (buf[i] == '\n')
+            c->freshline = true;
     }
-    assert(chr >= 0 && chr < 256);
+}
 
-#ifdef SYS
-    int fd = open(argv[2], O_RDONLY);
-    if (fd == -1) {
-        perror("Failed to open file");
-        exit(1);
+#ifdef __x86_64__
+// Counts one 64-byte block given bitmasks of matching bytes and newlines.
+// A match starts a new matching line if no other match lies between it and the start of its line.
+// Adding the line start bits to the mask of all other bytes carries each start up to the first match after it,
+// while a newline absorbs the carry, so it never leaks into the next line. Carry out of the top bit means
+// the last line hasn't matched yet.
+static inline void count_masks(struct counter *c, uint64_t match, uint64_t nl) {
+    c->matchbytes += __builtin_popcountll(match);
+    if (c->chr == '\n') { // every match ends its own line
+        c->matchlines += __builtin_popcountll(match);
+        return;
     }
-#else
-    FILE *file = fopen(argv[2], "rb");
-    if (file == NULL) {
-        perror("Failed to open file");
-        exit(1);
+    uint64_t rest = ~(match | nl);
+    uint64_t sum = rest + ((nl << 1) | c->freshline);
+    c->matchlines += __builtin_popcountll(sum & match);
+    c->freshline = sum < rest || (nl >> 63) != 0;
+}
+
+__attribute__((target("avx2,popcnt")))
+static void count_avx2(struct counter *c, const char *buf, size_t len) {
+    const __m256i vchr = _mm256_set1_epi8(c->chr), vnl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)(buf + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i*)(buf + i + 32));
+        uint64_t match = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vchr))
+            | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vchr)) << 32;
+        uint64_t nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vnl))
+            | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vnl)) << 32;
+        count_masks(c, match, nl);
     }
+    count_scalar(c, buf + i, len - i);
+}
+
+static void count_sse2(struct counter *c, const char *buf, size_t len) {
+    const __m128i vchr = _mm_set1_epi8(c->chr), vnl = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t match = 0, nl = 0;
+        for (int j = 0; j < 4; j++) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(buf + i + 16 * j));
+            match |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vchr)) << (16 * j);
+            nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl)) << (16 * j);
+        }
+        count_masks(c, match, nl);
+    }
+    count_scalar(c, buf + i, len - i);
+}
+#endif
+
+// Picks the fastest kernel the CPU supports
+static void (*select_kernel(void))(struct counter*, const char*, size_t) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return count_avx2;
+    return count_sse2;
+#else
+    return count_scalar;
 #endif
+}
+
+// Inverse of interpret_char(), buf needs room for 5 bytes
+static const char *format_char(unsigned char c, char *buf) {
+    switch (c) {
+        case '\r': return "\\r";
+        case '\n': return "\\n";
+        case '\t': return "\\t";
+        case '\b': return "\\b";
+        case '\v': return "\\v";
+        case '\a': return "\\a";
+        case '\f': return "\\f";
+        case '\\': return "\\\\";
+    }
+    if (c >= ' ' && c < 127) sprintf(buf, "%c", c);
+    else sprintf(buf, "\\%03o", c);
+    return buf;
+}
+
+// Settings shared by all workers, fixed before they start
+static bool showhist;                  // -H
+static bool dohist, stamped;           // histogram loop runs, and tracks the queries' lines too
+static int nqueries;
+static char querychrs[256];
+static bool isquery[256];
+static void (*count)(struct counter*, const char*, size_t);
+static enum backend backend = DEFAULT_BACKEND;
+static size_t bufsize = BUFSIZE;
+static bool listlines;                 // -n
+static uint64_t firstline, lastline;   // -L, 0 if not given
+
+// Histogram mode state of one worker: counts of every byte value, and matched lines for the query bytes
+struct histogram {
+    uint64_t part[4][256]; // partial byte counts, merged at the end
+    uint64_t lines[256];
+    uint64_t stamp[256];   // line number in which the byte was last counted
+    uint64_t line;
+};
+
+// One loop builds the whole histogram. Consecutive bytes go to different partial tables, so a run of
+// the same byte doesn't make every increment wait on the store of the previous one.
+static void histogram(struct histogram *h, const char *buf, size_t len, bool lines) {
+    const unsigned char *p = (const unsigned char*)buf;
+#define STEP(k) do { \
+        unsigned char b = p[i + (k)]; \
+        h->part[k][b]++; \
+        if (lines) { \
+            if (isquery[b] && h->stamp[b] != h->line) { \
+                h->stamp[b] = h->line; \
+                h->lines[b]++; \
+            } \
+            h->line += b == '\n'; \
+        } \
+    } while (0)
+    size_t i = 0;
+    if (lines) {
+        for (; i + 4 <= len; i += 4) {
+            STEP(0); STEP(1); STEP(2); STEP(3);
+        }
+    } else {
+        for (; i + 4 <= len; i += 4) { // separate loop, so the line tracking is compiled out
+            STEP(0); STEP(1); STEP(2); STEP(3);
+        }
+    }
+    for (; i < len; i++) STEP(0);
+#undef STEP
+}
+
+// Part of a file counted by one worker, the whole file unless -p splits it
+struct piece {
+    size_t file;     // index into paths
+    off_t start;
+    off_t end;       // -1: until EOF
+    bool last;       // last piece of its file
+    uint64_t line;   // number of the line the piece starts in, only known for -n
+};
 
-    ssize_t nbuf = 0;
-    char buf[1024];
+// Results of one piece. Lines are counted as if the piece started on a fresh line, the head (everything before
+// its first newline) is tracked separately, so merge() can correct for a line that already matched earlier.
+struct result {
+    bool failed;
+    bool inhead;                 // haven't seen a newline yet
+    struct counter queries[256]; // the first nqueries are used
+    bool headmatch[256];         // query matched in the head
+    uint64_t bytes[256];         // histogram mode only
+    uint64_t line;               // -n: current line number
+    uint64_t *matches;           // -n: numbers of matching lines
+    size_t nmatches, capmatches;
+};
 
-    unsigned matchlines = 0, matchbytes = 0;
-    bool freshline = true;
+static size_t count_newlines(const char *buf, size_t len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) n += buf[i] == '\n'; // vectorized by the compiler
+    return n;
+}
 
+// -n: records the number of every line containing the query character, skipping to the next line after a match
+static void list_matches(struct result *r, const char *buf, size_t len) {
+    const char *p = buf, *end = buf + len;
+    char c = querychrs[0];
+    const char *m;
+    while ((m = memchr(p, c, end - p)) != NULL) {
+        r->line += count_newlines(p, m - p);
+        if (r->nmatches == 0 || r->matches[r->nmatches - 1] != r->line) {
+            if (r->nmatches == r->capmatches) {
+                r->capmatches = r->capmatches ? r->capmatches * 2 : 64;
+                r->matches = realloc(r->matches, r->capmatches * sizeof(uint64_t));
+                if (r->matches == NULL) {
+                    perror("Failed to allocate line list");
+                    exit(1);
+                }
+            }
+            r->matches[r->nmatches++] = r->line;
+        }
+        const char *nl = c == '\n' ? m : memchr(m, '\n', end - m);
+        if (nl == NULL) return; // rest of the buffer is on the same line
+        r->line++;
+        p = nl + 1;
+    }
+    r->line += count_newlines(p, end - p);
+}
+
+static void scan(struct histogram *h, struct result *r, const char *buf, size_t len) {
+    if (r->inhead) {
+        const char *nl = memchr(buf, '\n', len);
+        size_t headlen = nl != NULL ? (size_t)(nl - buf) : len;
+        for (int q = 0; q < nqueries; q++)
+            r->headmatch[q] |= memchr(buf, querychrs[q], headlen) != NULL;
+        r->inhead = nl == NULL;
+    }
+    // Every query works on the same buffer while it's still in cache
+    if (dohist) histogram(h, buf, len, stamped);
+    if (!stamped) for (int q = 0; q < nqueries; q++) count(&r->queries[q], buf, len);
+    if (listlines) list_matches(r, buf, len);
+}
+
+// How much to read next, O_DIRECT reads have to be whole blocks even at the end of the file
+static size_t chunk(const struct piece *pc, off_t pos) {
+    size_t want = bufsize;
+    if (pc->end >= 0 && pc->end - pos < (off_t)want) want = pc->end - pos;
+    if (backend == IO_DIRECT) want = (want + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    return want;
+}
+
+static bool scan_fd(const char *path, int fd, const struct piece *pc, struct histogram *h, char *buf, struct result *r) {
+    ssize_t nbuf;
+    off_t pos = pc->start;
+    // O_DIRECT can only read from block boundaries, a piece starting at a line (-L) has to skip some bytes
+    size_t skip = backend == IO_DIRECT ? pos % DIRECT_ALIGN : 0;
+    pos -= skip;
     do {
-#ifdef SYS
-        nbuf = read(fd, buf, sizeof(buf));
+        // Whole files are read sequentially, so pipes work too
+        nbuf = pc->end < 0 && pc->start == 0 ? read(fd, buf, chunk(pc, pos)) : pread(fd, buf, chunk(pc, pos), pos);
         if (nbuf == -1) {
-            perror("Failed to read from file");
-            exit(1);
+            fprintf(stderr, "Failed to read from file %s: %s\n", path, strerror(errno));
+            return false;
         }
-#else
-        nbuf = (ssize_t) fread(buf, 1, sizeof(buf), file);
+        if (pc->end >= 0 && nbuf > pc->end - pos) nbuf = pc->end - pos;
+        pos += nbuf;
+        if ((size_t)nbuf < skip) break;
+        scan(h, r, buf + skip, nbuf - skip);
+        nbuf -= skip;
+        skip = 0;
+    } while (nbuf > 0);
+    return true;
+}
+
+static bool scan_stdio(const char *path, const struct piece *pc, struct histogram *h, char *buf, struct result *r) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (pc->start > 0 && fseeko(file, pc->start, SEEK_SET) != 0) {
+        fprintf(stderr, "Failed to seek in file %s: %s\n", path, strerror(errno));
+        fclose(file);
+        return false;
+    }
+    ssize_t nbuf;
+    off_t pos = pc->start;
+    do {
+        nbuf = (ssize_t) fread(buf, 1, chunk(pc, pos), file);
+        pos += nbuf;
         if (nbuf == 0 && ferror(file) != 0) {
-            perror("Failed to read from file");
+            fprintf(stderr, "Failed to read from file %s: %s\n", path, strerror(errno));
+            fclose(file);
+            return false;
+        }
+        scan(h, r, buf, nbuf);
+    } while (nbuf > 0);
+    fclose(file);
+    return true;
+}
+
+// Returns -1 if the file can't be mapped (not a regular file), so the caller can fall back to read()
+static int scan_mmap(int fd, const struct piece *pc, off_t filesize, struct histogram *h, struct result *r) {
+    off_t end = pc->end < 0 || pc->end > filesize ? filesize : pc->end;
+    off_t mapstart = pc->start - pc->start % sysconf(_SC_PAGESIZE); // -L pieces start anywhere
+    if (end <= pc->start) return 1;
+    char *map = mmap(NULL, end - mapstart, PROT_READ, MAP_PRIVATE, fd, mapstart);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, end - mapstart, MADV_SEQUENTIAL);
+    // Still scanned in buffer-sized pieces, so all queries hit the cache
+    for (off_t off = pc->start - mapstart; off < end - mapstart; off += bufsize)
+        scan(h, r, map + off, end - mapstart - off < (off_t)bufsize ? end - mapstart - off : (off_t)bufsize);
+    munmap(map, end - mapstart);
+    return 1;
+}
+
+static bool scan_file(const char *path, const struct piece *pc, struct histogram *h, char *buf, struct result *r) {
+    r->inhead = true;
+    r->line = pc->line;
+    r->nmatches = 0;
+    for (int q = 0; q < nqueries; q++)
+        r->queries[q] = (struct counter) { .matchlines = 0, .matchbytes = 0, .freshline = true, .chr = querychrs[q] };
+    if (dohist) {
+        memset(h, 0, sizeof(*h));
+        for (int b = 0; b < 256; b++) h->stamp[b] = UINT64_MAX; // line 0 hasn't been counted yet
+    }
+
+    bool ok;
+    if (backend == IO_STDIO) {
+        ok = scan_stdio(path, pc, h, buf, r);
+    } else {
+        int fd = open(path, O_RDONLY | (backend == IO_DIRECT ? O_DIRECT : 0));
+        if (fd == -1 && backend == IO_DIRECT && errno == EINVAL) {
+            static bool warned = false;
+            if (!__atomic_exchange_n(&warned, true, __ATOMIC_RELAXED))
+                fprintf(stderr, "O_DIRECT not supported for %s, falling back to buffered reads\n", path);
+            fd = open(path, O_RDONLY);
+        }
+        if (fd == -1) {
+            fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
+            return false;
+        }
+        struct stat sb;
+        int mapped = 0;
+        if ((backend == IO_MMAP || backend == IO_AUTO) && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode)
+                && (backend == IO_MMAP || sb.st_size >= MMAP_MIN)) {
+            mapped = scan_mmap(fd, pc, sb.st_size, h, r);
+        }
+        if (backend == IO_FADVISE) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+        ok = mapped > 0 || scan_fd(path, fd, pc, h, buf, r);
+        close(fd);
+    }
+    if (!ok) return false;
+
+    if (dohist) {
+        for (int b = 0; b < 256; b++)
+            r->bytes[b] = h->part[0][b] + h->part[1][b] + h->part[2][b] + h->part[3][b];
+        if (stamped) {
+            for (int q = 0; q < nqueries; q++) {
+                unsigned char c = querychrs[q];
+                r->queries[q].matchlines = h->lines[c];
+                r->queries[q].matchbytes = r->bytes[c];
+                r->queries[q].freshline = h->stamp[c] != h->line;
+            }
+        }
+    }
+    return true;
+}
+
+// Buffer usable by every backend, O_DIRECT needs it aligned and a multiple of the block size
+static char *alloc_buffer(void) {
+    void *buf;
+    if (posix_memalign(&buf, DIRECT_ALIGN, (bufsize + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN) != 0) {
+        perror("Failed to allocate buffer");
+        exit(1);
+    }
+    return buf;
+}
+
+// Sidecar newline index (<file>.nlidx), built with -x. Layout, meant to be mmap()ed:
+//   struct index_header
+//   struct index_checkpoint[ncheckpoints] - offset of every INDEX_INTERVAL-th newline
+//   uint8_t deltas[ndeltabytes]           - distance from each newline to the next, as LEB128 varints
+// The distance to the first newline is counted from offset -1, so every delta is at least 1.
+struct index_header {
+    char magic[8];
+    uint64_t filesize;
+    int64_t mtime_sec, mtime_nsec; // of the indexed file, to detect stale indexes
+    uint64_t newlines;
+    uint64_t interval;
+    uint64_t ncheckpoints;
+    uint64_t ndeltabytes;
+};
+
+struct index_checkpoint {
+    uint64_t offset;   // of newline number k * interval
+    uint64_t deltapos; // where the delta to the newline after it starts
+};
+
+static const char index_magic[8] = { 'N', 'L', 'I', 'D', 'X', '\0', '\0', '\1' };
+
+struct nlindex {
+    const struct index_header *hdr;
+    const struct index_checkpoint *cps;
+    const uint8_t *deltas;
+    void *mem;
+    size_t memsize;
+    bool mapped;
+};
+
+static uint64_t read_varint(const uint8_t **p) {
+    uint64_t val = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t b = *(*p)++;
+        val |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return val;
+    }
+}
+
+// Offset of newline number k, counting from 0
+static uint64_t index_newline(const struct nlindex *idx, uint64_t k) {
+    assert(k < idx->hdr->newlines);
+    const struct index_checkpoint *cp = &idx->cps[k / idx->hdr->interval];
+    uint64_t off = cp->offset;
+    const uint8_t *p = idx->deltas + cp->deltapos;
+    for (uint64_t i = k % idx->hdr->interval; i > 0; i--) off += read_varint(&p);
+    return off;
+}
+
+// Offset at which a line starts, lines are numbered from 1. Lines after the last one start at EOF.
+static uint64_t index_line_start(const struct nlindex *idx, uint64_t line) {
+    if (line <= 1) return 0;
+    if (line - 2 >= idx->hdr->newlines) return idx->hdr->filesize;
+    return index_newline(idx, line - 2) + 1;
+}
+
+// Number of the line containing the byte at off
+static uint64_t index_line_at(const struct nlindex *idx, uint64_t off) {
+    const struct index_header *hdr = idx->hdr;
+    if (hdr->newlines == 0 || idx->cps[0].offset >= off) return 1;
+    uint64_t lo = 0, hi = hdr->ncheckpoints; // last checkpoint before off is in [lo, hi)
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (idx->cps[mid].offset < off) lo = mid;
+        else hi = mid;
+    }
+    uint64_t k = lo * hdr->interval, nl = idx->cps[lo].offset;
+    const uint8_t *p = idx->deltas + idx->cps[lo].deltapos;
+    // Only up to the end of this checkpoint's group, the next one starts at or after off
+    while (k + 1 < hdr->newlines && k + 1 < (lo + 1) * hdr->interval) {
+        const uint8_t *q = p;
+        uint64_t next = nl + read_varint(&q);
+        if (next >= off) break;
+        nl = next;
+        p = q;
+        k++;
+    }
+    return k + 2; // newline k is before off, so off is in the line after it
+}
+
+static void free_index(struct nlindex *idx) {
+    if (idx->mapped) munmap(idx->mem, idx->memsize);
+    else free(idx->mem);
+    idx->mem = NULL;
+}
+
+// Scans the file and builds its index in memory
+static bool build_index(const char *path, struct nlindex *idx) {
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "Failed to open file %s: %s\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    size_t capcp = 64, capdelta = 4096, ncp = 0, ndelta = 0;
+    struct index_checkpoint *cps = malloc(capcp * sizeof(struct index_checkpoint));
+    uint8_t *deltas = malloc(capdelta);
+    char *buf = malloc(1 << 20);
+    if (cps == NULL || deltas == NULL || buf == NULL) {
+        perror("Failed to allocate index");
+        exit(1);
+    }
+    uint64_t newlines = 0, prev = (uint64_t)-1, off = 0;
+    ssize_t nbuf;
+    while ((nbuf = read(fd, buf, 1 << 20)) > 0) {
+        for (const char *p = buf, *nl; (nl = memchr(p, '\n', buf + nbuf - p)) != NULL; p = nl + 1) {
+            uint64_t pos = off + (nl - buf);
+            if (newlines % INDEX_INTERVAL == 0) {
+                if (ncp == capcp) cps = realloc(cps, (capcp *= 2) * sizeof(struct index_checkpoint));
+                if (cps == NULL) {
+                    perror("Failed to allocate index");
+                    exit(1);
+                }
+                cps[ncp++] = (struct index_checkpoint) { .offset = pos, .deltapos = ndelta };
+            } else {
+                if (capdelta - ndelta < 10) deltas = realloc(deltas, capdelta *= 2);
+                if (deltas == NULL) {
+                    perror("Failed to allocate index");
+                    exit(1);
+                }
+                for (uint64_t d = pos - prev; ; d >>= 7) {
+                    deltas[ndelta++] = (d & 0x7f) | (d >= 0x80 ? 0x80 : 0);
+                    if (d < 0x80) break;
+                }
+            }
+            prev = pos;
+            newlines++;
+        }
+        off += nbuf;
+    }
+    if (nbuf == -1) {
+        fprintf(stderr, "Failed to read from file %s: %s\n", path, strerror(errno));
+        close(fd);
+        free(buf); free(cps); free(deltas);
+        return false;
+    }
+    close(fd);
+    free(buf);
+
+    // Assemble everything into the on-disk layout
+    idx->memsize = sizeof(struct index_header) + ncp * sizeof(struct index_checkpoint) + ndelta;
+    idx->mem = malloc(idx->memsize);
+    if (idx->mem == NULL) {
+        perror("Failed to allocate index");
+        exit(1);
+    }
+    idx->mapped = false;
+    struct index_header *hdr = idx->mem;
+    memcpy(hdr->magic, index_magic, sizeof(index_magic));
+    hdr->filesize = off;
+    hdr->mtime_sec = sb.st_mtim.tv_sec;
+    hdr->mtime_nsec = sb.st_mtim.tv_nsec;
+    hdr->newlines = newlines;
+    hdr->interval = INDEX_INTERVAL;
+    hdr->ncheckpoints = ncp;
+    hdr->ndeltabytes = ndelta;
+    memcpy(hdr + 1, cps, ncp * sizeof(struct index_checkpoint));
+    memcpy((char*)(hdr + 1) + ncp * sizeof(struct index_checkpoint), deltas, ndelta);
+    free(cps);
+    free(deltas);
+    idx->hdr = hdr;
+    idx->cps = (const struct index_checkpoint*)(hdr + 1);
+    idx->deltas = (const uint8_t*)(idx->cps + ncp);
+    return true;
+}
+
+static bool save_index(const char *path, const struct nlindex *idx) {
+    size_t len = strlen(path);
+    char *idxpath = malloc(len + sizeof(INDEX_SUFFIX) + 4), *tmppath = malloc(len + sizeof(INDEX_SUFFIX) + 4);
+    if (idxpath == NULL || tmppath == NULL) {
+        perror("Failed to allocate index path");
+        exit(1);
+    }
+    sprintf(idxpath, "%s" INDEX_SUFFIX, path);
+    sprintf(tmppath, "%s" INDEX_SUFFIX ".tmp", path);
+    bool ok = false;
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd != -1) {
+        const char *p = idx->mem;
+        size_t left = idx->memsize;
+        ssize_t written = 0;
+        while (left > 0 && (written = write(fd, p, left)) > 0) {
+            p += written;
+            left -= written;
+        }
+        ok = left == 0 && close(fd) == 0 && rename(tmppath, idxpath) == 0;
+        if (!ok) unlink(tmppath);
+    }
+    if (!ok) fprintf(stderr, "Failed to write index %s: %s\n", idxpath, strerror(errno));
+    free(idxpath);
+    free(tmppath);
+    return ok;
+}
+
+// Maps the sidecar index of a file, fails if there is none or it doesn't match the file anymore
+static bool load_index(const char *path, struct nlindex *idx) {
+    size_t len = strlen(path);
+    char *idxpath = malloc(len + sizeof(INDEX_SUFFIX));
+    if (idxpath == NULL) {
+        perror("Failed to allocate index path");
+        exit(1);
+    }
+    sprintf(idxpath, "%s" INDEX_SUFFIX, path);
+    int fd = open(idxpath, O_RDONLY);
+    free(idxpath);
+    struct stat sb, isb;
+    if (fd == -1) return false;
+    if (stat(path, &sb) == -1 || fstat(fd, &isb) == -1 || (size_t)isb.st_size < sizeof(struct index_header)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, isb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    const struct index_header *hdr = map;
+    if (memcmp(hdr->magic, index_magic, sizeof(index_magic)) != 0 || hdr->filesize != (uint64_t)sb.st_size
+            || hdr->mtime_sec != sb.st_mtim.tv_sec || hdr->mtime_nsec != sb.st_mtim.tv_nsec
+            || hdr->interval == 0 || hdr->ncheckpoints != (hdr->newlines + hdr->interval - 1) / hdr->interval
+            || sizeof(struct index_header) + hdr->ncheckpoints * sizeof(struct index_checkpoint) + hdr->ndeltabytes != (uint64_t)isb.st_size) {
+        munmap(map, isb.st_size);
+        return false;
+    }
+    idx->mem = map;
+    idx->memsize = isb.st_size;
+    idx->mapped = true;
+    idx->hdr = hdr;
+    idx->cps = (const struct index_checkpoint*)(hdr + 1);
+    idx->deltas = (const uint8_t*)(idx->cps + hdr->ncheckpoints);
+    return true;
+}
+
+// Pieces are handed out to workers in order, file results are printed in the same order as soon as
+// all earlier pieces are done
+static const char **paths;
+static size_t npaths;
+static struct piece *pieces;
+static size_t npieces;
+static size_t nextpiece;
+static struct result **results;
+static size_t nextout;
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool single; // original output format
+static bool mkindex; // -x
+static struct result current; // file whose pieces are being merged
+static uint64_t lastlisted; // -n: last line printed for the current file
+static struct result total;
+static bool anyfailed;
+
+static void reset_result(struct result *r) {
+    free(r->matches);
+    memset(r, 0, sizeof(*r));
+    for (int q = 0; q < nqueries; q++)
+        r->queries[q] = (struct counter) { .matchlines = 0, .matchbytes = 0, .freshline = true, .chr = querychrs[q] };
+}
+
+// Adds the result of the next piece to that of its file. If the line the piece starts in matched in an earlier
+// piece already, the piece counted that line again.
+static void merge(struct result *acc, const struct result *r) {
+    acc->failed |= r->failed;
+    for (int q = 0; q < nqueries; q++) {
+        struct counter *a = &acc->queries[q];
+        const struct counter *c = &r->queries[q];
+        a->matchlines += c->matchlines - (!a->freshline && r->headmatch[q]);
+        a->matchbytes += c->matchbytes;
+        a->freshline = r->inhead ? a->freshline && !r->headmatch[q] : c->freshline;
+    }
+    for (int b = 0; b < 256; b++) acc->bytes[b] += r->bytes[b];
+}
+
+static void print_result(const char *path, struct result *r) {
+    char fmtbuf[8];
+    if (single) {
+        printf("%s\t%lu\t%lu\n", path, r->queries[0].matchlines, r->queries[0].matchbytes);
+        return;
+    }
+    for (int q = 0; q < nqueries; q++)
+        printf("%s\t%s\t%lu\t%lu\n", path, format_char(querychrs[q], fmtbuf), r->queries[q].matchlines, r->queries[q].matchbytes);
+    if (showhist) {
+        if (nqueries > 0) printf("\n");
+        for (int b = 0; b < 256; b++) {
+            if (r->bytes[b] > 0) printf("%s\t%s\t%lu\n", path, format_char(b, fmtbuf), r->bytes[b]);
+        }
+    }
+}
+
+static void finish(size_t i, struct result *r) {
+    pthread_mutex_lock(&outlock);
+    results[i] = r;
+    for (; nextout < npieces && results[nextout] != NULL; nextout++) {
+        merge(&current, results[nextout]);
+        // A line spanning two pieces is listed by both
+        for (size_t m = 0; m < results[nextout]->nmatches; m++) {
+            if (results[nextout]->matches[m] == lastlisted) continue;
+            lastlisted = results[nextout]->matches[m];
+            printf("%s:%lu\n", paths[pieces[nextout].file], lastlisted);
+        }
+        free(results[nextout]->matches);
+        free(results[nextout]);
+        results[nextout] = NULL;
+        if (!pieces[nextout].last) continue;
+        if (current.failed) {
+            anyfailed = true;
+        } else {
+            print_result(paths[pieces[nextout].file], &current);
+            for (int q = 0; q < nqueries; q++) {
+                total.queries[q].matchlines += current.queries[q].matchlines;
+                total.queries[q].matchbytes += current.queries[q].matchbytes;
+            }
+            for (int b = 0; b < 256; b++) total.bytes[b] += current.bytes[b];
+        }
+        reset_result(&current);
+        lastlisted = 0;
+    }
+    pthread_mutex_unlock(&outlock);
+}
+
+// Sidecar index of a file, built (and with -x saved) if there is no usable one yet
+static bool get_index(const char *path, struct nlindex *idx) {
+    if (load_index(path, idx)) return true;
+    if (!build_index(path, idx)) return false;
+    if (mkindex && !save_index(path, idx)) anyfailed = true; // still usable for this run
+    return true;
+}
+
+static void add_piece(size_t *cap, struct piece pc) {
+    if (npieces == *cap) pieces = realloc(pieces, (*cap *= 2) * sizeof(struct piece));
+    if (pieces == NULL) {
+        perror("Failed to allocate pieces");
+        exit(1);
+    }
+    pieces[npieces++] = pc;
+}
+
+// -p: splits big regular files into ranges, so a single file can be counted by all workers.
+// -L: the line range is looked up in the index, only its bytes are read. -n: pieces starting after the
+// first line get their line number from the index.
+static void split_files(bool split, long threads) {
+    size_t cap = npaths;
+    pieces = malloc(cap * sizeof(struct piece));
+    for (size_t f = 0; f < npaths; f++) {
+        struct stat sb;
+        struct nlindex idx = { .mem = NULL };
+        errno = 0;
+        bool regular = stat(paths[f], &sb) == 0 && S_ISREG(sb.st_mode);
+        off_t start = 0, end = regular ? sb.st_size : 0, step = 0;
+        if (firstline > 0) {
+            if (!regular) {
+                if (errno != 0) fprintf(stderr, "Failed to stat file %s: %s\n", paths[f], strerror(errno));
+                else fprintf(stderr, "Line ranges need a regular file: %s\n", paths[f]);
+                anyfailed = true;
+                continue;
+            }
+            if (!get_index(paths[f], &idx)) {
+                anyfailed = true;
+                continue;
+            }
+            start = index_line_start(&idx, firstline);
+            end = index_line_start(&idx, lastline + 1);
+        } else if (regular && (mkindex || (split && listlines)) && !get_index(paths[f], &idx)) {
+            anyfailed = true;
+        }
+        if (split && regular) {
+            step = ((end - start) / threads + PIECE_ALIGN - 1) / PIECE_ALIGN * PIECE_ALIGN;
+            if (step < PIECE_MIN) step = PIECE_MIN;
+            if (listlines && idx.mem == NULL) step = 0; // can't tell line numbers
+        }
+        if (step == 0 || end - start <= step) {
+            add_piece(&cap, (struct piece) { .file = f, .start = start, .end = firstline > 0 ? end : -1, .last = true,
+                    .line = firstline > 0 ? firstline : 1 });
+        } else {
+            for (off_t pos = start, next; pos < end; pos = next) {
+                next = pos / PIECE_ALIGN * PIECE_ALIGN + step;
+                // The last piece reads until EOF, in case the file grew since stat()
+                bool last = next >= end;
+                add_piece(&cap, (struct piece) { .file = f, .start = pos, .end = !last ? next : firstline > 0 ? end : -1, .last = last,
+                        .line = pos == start ? (firstline > 0 ? firstline : 1) : listlines ? index_line_at(&idx, pos) : 0 });
+            }
+        }
+        if (idx.mem != NULL) free_index(&idx);
+    }
+}
+
+static void* worker(void *_arg) {
+    (void)_arg;
+    char *buf = alloc_buffer();
+    struct histogram *h = malloc(sizeof(struct histogram));
+    if (h == NULL) {
+        perror("Failed to allocate buffer");
+        exit(1);
+    }
+    size_t i;
+    while ((i = __atomic_fetch_add(&nextpiece, 1, __ATOMIC_RELAXED)) < npieces) {
+        struct result *r = calloc(1, sizeof(struct result));
+        if (r == NULL) {
+            perror("Failed to allocate result");
             exit(1);
         }
-#endif
-        for (int i = 0; i < nbuf; i++) {
-            if (buf[i] == (char)chr) {
-                matchbytes++;
-                if (freshline) matchlines++;
-                freshline = false;
+        r->failed = !scan_file(paths[pieces[i].file], &pieces[i], h, buf, r);
+        finish(i, r);
+    }
+    free(h);
+    free(buf);
+    return NULL;
+}
+
+// Reads a NUL-separated list of paths, as printed by find -print0
+static void read_paths(FILE *in) {
+    size_t cap = 0, len = 0, n;
+    char *data = NULL;
+    do {
+        if (cap - len < 4096) {
+            cap = cap ? cap * 2 : 65536;
+            data = realloc(data, cap + 1);
+            if (data == NULL) {
+                perror("Failed to allocate path list");
+                exit(1);
             }
-            if (buf[i] == '\n')
-                freshline = true;
         }
-    } while (nbuf > 0);
+        n = fread(data + len, 1, cap - len, in);
+        len += n;
+    } while (n > 0);
+    if (ferror(in)) {
+        perror("Failed to read path list");
+        exit(1);
+    }
+    data[len] = '\0'; // terminate an unterminated last entry
+    size_t pcap = 64;
+    paths = malloc(pcap * sizeof(*paths));
+    for (size_t off = 0; off < len; off += strlen(data + off) + 1) {
+        if (data[off] == '\0') continue;
+        if (npaths == pcap) paths = realloc(paths, (pcap *= 2) * sizeof(*paths));
+        if (paths == NULL) {
+            perror("Failed to allocate path list");
+            exit(1);
+        }
+        paths[npaths++] = data + off;
+    }
+}
+
+static double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Compares field by field, the padding of struct counter isn't initialized
+static bool same_counts(const struct result *a, const struct result *b) {
+    for (int q = 0; q < nqueries; q++) {
+        if (a->queries[q].matchlines != b->queries[q].matchlines || a->queries[q].matchbytes != b->queries[q].matchbytes) return false;
+    }
+    return !dohist || memcmp(a->bytes, b->bytes, sizeof(a->bytes)) == 0;
+}
+
+// -B: runs every backend with a range of buffer sizes over one file, with cold and warm page cache, and
+// prints the timings as CSV. Cold runs drop the file from the cache with POSIX_FADV_DONTNEED first, which
+// only works for pages that aren't dirty or mapped elsewhere.
+static void benchmark(const char *path) {
+    static const size_t sizes[] = { 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304 };
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        perror("Failed to stat file");
+        exit(1);
+    }
+    struct histogram *h = malloc(sizeof(struct histogram));
+    struct result *r = calloc(1, sizeof(struct result)), *first = calloc(1, sizeof(struct result));
+    if (h == NULL || r == NULL || first == NULL) {
+        perror("Failed to allocate result");
+        exit(1);
+    }
+    bool havefirst = false;
+    const struct piece whole = { .file = 0, .start = 0, .end = -1, .last = true };
+    printf("backend,bufsize,cache,run,wall_s,user_s,sys_s,mb_per_s\n");
+    for (backend = IO_READ; backend < IO_COUNT; backend++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            if (backend == IO_DIRECT && sizes[s] % DIRECT_ALIGN != 0) continue;
+            bufsize = sizes[s];
+            char *buf = alloc_buffer();
+            for (int cold = 1; cold >= 0; cold--) {
+                if (!cold && !scan_file(path, &whole, h, buf, r)) exit(1); // warm up
+                for (int run = 0; run < BENCH_RUNS; run++) {
+                    if (cold) {
+                        int fd = open(path, O_RDONLY);
+                        if (fd == -1 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+                            perror("Failed to drop file from cache");
+                            exit(1);
+                        }
+                        close(fd);
+                    }
+                    struct timespec start, end;
+                    struct rusage ustart, uend;
+                    if (clock_gettime(CLOCK_MONOTONIC, &start) < 0) { perror("Failed to get time"); exit(1); }
+                    getrusage(RUSAGE_SELF, &ustart);
+                    if (!scan_file(path, &whole, h, buf, r)) exit(1);
+                    getrusage(RUSAGE_SELF, &uend);
+                    if (clock_gettime(CLOCK_MONOTONIC, &end) < 0) { perror("Failed to get time"); exit(1); }
+                    // All strategies have to agree on the result
+                    if (!havefirst) {
+                        memcpy(first, r, sizeof(struct result));
+                        havefirst = true;
+                    } else if (!same_counts(first, r)) {
+                        fprintf(stderr, "Backend %s with buffer size %zu gave a different result!\n", backend_names[backend], bufsize);
+                        exit(1);
+                    }
+                    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+                    printf("%s,%zu,%s,%d,%.4f,%.4f,%.4f,%.1f\n", backend_names[backend], bufsize, cold ? "cold" : "warm", run + 1,
+                            wall, seconds(uend.ru_utime) - seconds(ustart.ru_utime), seconds(uend.ru_stime) - seconds(ustart.ru_stime),
+                            sb.st_size / 1e6 / wall);
+                    fflush(stdout);
+                }
+            }
+            free(buf);
+        }
+    }
+    free(first);
+    free(r);
+    free(h);
+}
+
+static void add_query(int chr) {
+    if (isquery[chr]) return;
+    isquery[chr] = true;
+    querychrs[nqueries++] = (char)chr;
+}
+
+int main(int argc, char** argv) {
+    bool fromstdin = false, bench = false, split = false;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN), size;
+    int opt, chr;
+    char *endptr;
+    while ((opt = getopt(argc, argv, "Hc:j:p0I:b:BxL:n")) != -1) {
+        switch (opt) {
+            case 'H': showhist = true; break;
+            case 'c':
+                if ((chr = interpret_char(optarg)) == -1) argc = 0; // print usage
+                else add_query(chr);
+                break;
+            case 'j':
+                threads = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || threads <= 0) argc = 0;
+                break;
+            case 'p': split = true; break;
+            case '0': fromstdin = true; break;
+            case 'I':
+                for (backend = 0; backend < IO_COUNT && strcmp(optarg, backend_names[backend]) != 0; backend++);
+                if (backend == IO_COUNT) argc = 0;
+                break;
+            case 'b':
+                size = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || size <= 0) argc = 0;
+                else bufsize = size;
+                break;
+            case 'B': bench = true; break;
+            case 'x': mkindex = true; break;
+            case 'L':
+                firstline = strtoull(optarg, &endptr, 10);
+                lastline = *endptr == ':' ? strtoull(endptr + 1, &endptr, 10) : firstline;
+                if (*endptr != '\0' || firstline == 0 || lastline < firstline) argc = 0;
+                break;
+            case 'n': listlines = true; break;
+            default: argc = 0; break;
+        }
+    }
+    // Without -H or -c, the character is the first positional argument and the output keeps its original format
+    single = !showhist && nqueries == 0;
+    if (single && !mkindex && optind < argc && (chr = interpret_char(argv[optind++])) != -1)
+        add_query(chr);
+    if (argc <= 0 || (fromstdin ? argc != optind : argc == optind) || nqueries + showhist + mkindex == 0
+            || (bench && (fromstdin || argc - optind != 1)) || (listlines && (nqueries != 1 || showhist))) {
+        printf("Usage: %s [-j <threads>] <character> <file>...\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("       %s [-j <threads>] [-p] [-H] [-c <character>]... <file>...\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("       %s [-j <threads>] [-H] [-c <character>]... [<character>] -0 < file-list\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("       %s -B [-H] [-c <character>]... [<character>] <file>\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("       %s -x [-L <A>:<B>] [-n] [-H] [-c <character>]... <file>...\n", argc > 0 ? argv[0] : PROGNAME);
+        printf("  -H  print counts of every byte value\n");
+        printf("  -c  count lines and bytes for this character, can be repeated\n");
+        printf("  -j  number of worker threads, defaults to the number of CPUs\n");
+        printf("  -p  split big files into ranges counted in parallel\n");
+        printf("  -0  read a NUL-separated list of files from standard input\n");
+        printf("  -I  I/O strategy: auto (default for main-sys), read, stdio (default for main-lib), mmap, direct, fadvise\n");
+        printf("  -b  buffer size in bytes, default %d\n", BUFSIZE);
+        printf("  -B  benchmark all I/O strategies and buffer sizes on the file, print results as CSV\n");
+        printf("  -x  build or refresh the newline index of each file, saved next to it as <file>%s\n", INDEX_SUFFIX);
+        printf("  -L  only count lines A to B (given as A:B), uses the newline index\n");
+        printf("  -n  list the numbers of lines containing the character, which must be the only one\n");
+        exit(2);
+    }
+    if (fromstdin) {
+        read_paths(stdin);
+    } else {
+        paths = (const char**)(argv + optind);
+        npaths = argc - optind;
+    }
+
+    count = select_kernel();
+    if (backend == IO_DIRECT) bufsize = (bufsize + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    // A few queries are cheaper as separate SIMD scans of the buffer, many are tracked by the histogram loop
+    stamped = nqueries > MAX_SCANS;
+    dohist = showhist || stamped;
+
+    if (bench) {
+        benchmark(paths[0]);
+        return 0;
+    }
+
+    split_files(split, threads);
+    if (nqueries + dohist == 0) return anyfailed ? 1 : 0; // only indexing
+    reset_result(&current);
+    results = calloc(npieces + 1, sizeof(*results));
+    if (threads > (long)npieces) threads = npieces;
+    if (threads <= 1) {
+        worker(NULL);
+    } else {
+        pthread_t *tids = malloc(threads * sizeof(pthread_t));
+        for (long t = 0; t < threads; t++) {
+            if (pthread_create(&tids[t], NULL, worker, NULL) != 0) {
+                perror("Failed to create thread");
+                exit(1);
+            }
+        }
+        for (long t = 0; t < threads; t++) {
+            if (pthread_join(tids[t], NULL) != 0) {
+                perror("Failed to join thread");
+                exit(1);
+            }
+        }
+        free(tids);
+    }
+    free(results);
 
-    printf("%s\t%d\t%d\n", argv[2], matchlines, matchbytes);
+    if (npaths > 1) print_result("total", &total);
 
-    return 0;
+    return anyfailed ? 1 : 0;
 }
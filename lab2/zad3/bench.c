@@ -0,0 +1,331 @@
+// Mateusz Naściszewski, 2022
+// Walker benchmark: generates synthetic trees, runs every given walker command over each of them with cold and
+// warm cache and prints the timings as CSV
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> // PATH_MAX
+#include <fcntl.h> // open, openat
+#include <signal.h> // raise
+#include <time.h> // clock_gettime
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h> // struct rusage
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h> // struct sockaddr_un
+#include <sys/wait.h>
+#include <linux/ptrace.h> // struct ptrace_syscall_info
+
+#define BENCH_RUNS 3
+#define MAX_ARGS 32
+
+// --- Tree generation ---
+// Every tree comes from a fixed seed, so runs on different machines walk the same thing. A tree is only made
+// once, <name>.count next to it holds its number of entries (including the root) and marks it as complete.
+
+static uint64_t rng;
+
+static uint64_t next_random(void) { // xorshift64
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static uint64_t nentries;
+
+static void fail(const char *what, const char *name) {
+	fprintf(stderr, "%s %s: %s\n", what, name, strerror(errno));
+	exit(1);
+}
+
+static void make_dir(const char *name) {
+	if (mkdir(name, 0755) == -1) fail("Failed to create directory", name);
+	nentries++;
+}
+
+// Creates a file of the given size in the current directory
+static void make_file(const char *name, size_t size) {
+	static char data[65536];
+	int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) fail("Failed to create file", name);
+	while (size > 0) {
+		size_t n = size < sizeof(data) ? size : sizeof(data);
+		for (size_t i = 0; i < n; i++) data[i] = 'a' + next_random() % 26;
+		if (write(fd, data, n) != (ssize_t)n) fail("Failed to write file", name);
+		size -= n;
+	}
+	close(fd);
+	nentries++;
+}
+
+static void make_symlink(const char *target, const char *name) {
+	if (symlink(target, name) == -1) fail("Failed to create symlink", name);
+	nentries++;
+}
+
+static void make_fifo(const char *name) {
+	if (mkfifo(name, 0644) == -1) fail("Failed to create FIFO", name);
+	nentries++;
+}
+
+// Binds a socket to the name and closes it, the socket file stays behind
+static void make_socket(const char *name) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) fail("Failed to create socket", name);
+	close(fd);
+	nentries++;
+}
+
+static void enter(const char *name) {
+	if (chdir(name) == -1) fail("Failed to enter directory", name);
+}
+
+// Few directories with a lot of empty files each
+static void gen_wide(void) {
+	char name[32];
+	for (int d = 0; d < 4; d++) {
+		snprintf(name, sizeof(name), "dir%d", d);
+		make_dir(name);
+		enter(name);
+		for (int f = 0; f < 25000; f++) {
+			snprintf(name, sizeof(name), "file%05d", f);
+			make_file(name, 0);
+		}
+		enter("..");
+	}
+}
+
+// Chains of directories 200 levels deep with a few files on every level
+static void gen_deep(void) {
+	char name[32];
+	for (int c = 0; c < 64; c++) {
+		snprintf(name, sizeof(name), "chain%02d", c);
+		make_dir(name);
+		enter(name);
+		for (int level = 0; level < 200; level++) {
+			for (int f = 0; f < 4; f++) {
+				snprintf(name, sizeof(name), "file%d", f);
+				make_file(name, next_random() % 4096);
+			}
+			make_dir("d");
+			enter("d");
+		}
+		for (int level = 0; level <= 200; level++) enter("..");
+	}
+}
+
+// Lots of files of up to 256 bytes
+static void gen_tiny(void) {
+	char name[32];
+	for (int d = 0; d < 256; d++) {
+		snprintf(name, sizeof(name), "dir%03d", d);
+		make_dir(name);
+		enter(name);
+		for (int f = 0; f < 400; f++) {
+			snprintf(name, sizeof(name), "f%03d", f);
+			make_file(name, 1 + next_random() % 256);
+		}
+		enter("..");
+	}
+}
+
+// Every kind of entry: files, symlinks (some dangling), hard links, FIFOs, sockets and small subdirectories
+static void gen_mixed(void) {
+	char name[32], target[32];
+	for (int d = 0; d < 64; d++) {
+		snprintf(name, sizeof(name), "dir%02d", d);
+		make_dir(name);
+		enter(name);
+		make_file("base", 100);
+		for (int e = 0; e < 200; e++) {
+			unsigned kind = next_random() % 20;
+			snprintf(name, sizeof(name), "e%03d", e);
+			if (kind < 10) {
+				make_file(name, next_random() % 16384);
+			} else if (kind < 13) {
+				snprintf(target, sizeof(target), "e%03d", (int)(next_random() % 200)); // may not exist (yet)
+				make_symlink(target, name);
+			} else if (kind < 14) {
+				if (link("base", name) == -1) fail("Failed to create hard link", name);
+				nentries++;
+			} else if (kind < 16) {
+				make_fifo(name);
+			} else if (kind < 18) {
+				make_socket(name);
+			} else {
+				make_dir(name);
+				enter(name);
+				for (int f = 0; f < 20; f++) {
+					snprintf(name, sizeof(name), "f%02d", f);
+					make_file(name, next_random() % 1024);
+				}
+				enter("..");
+			}
+		}
+		enter("..");
+	}
+}
+
+static const struct tree {
+	const char *name;
+	void (*gen)(void);
+	uint64_t seed;
+} trees[] = {
+	{ "wide", gen_wide, 1 },
+	{ "deep", gen_deep, 2 },
+	{ "tiny", gen_tiny, 3 },
+	{ "mixed", gen_mixed, 4 },
+};
+
+// Makes the tree in dir unless it's there already, returns its number of entries
+static uint64_t make_tree(const char *dir, const struct tree *t) {
+	char countfile[PATH_MAX];
+	snprintf(countfile, sizeof(countfile), "%s/%s.count", dir, t->name);
+	FILE *f = fopen(countfile, "r");
+	if (f != NULL) {
+		unsigned long long n;
+		bool ok = fscanf(f, "%llu", &n) == 1;
+		fclose(f);
+		if (ok) return n;
+	}
+	int cwd = open(".", O_RDONLY | O_DIRECTORY);
+	if (cwd == -1) fail("Failed to open directory", ".");
+	fprintf(stderr, "Generating %s tree...\n", t->name);
+	enter(dir);
+	nentries = 0;
+	rng = t->seed * 0x9e3779b97f4a7c15u;
+	make_dir(t->name);
+	enter(t->name);
+	t->gen();
+	if (fchdir(cwd) == -1) fail("Failed to enter directory", ".");
+	close(cwd);
+	f = fopen(countfile, "w");
+	if (f == NULL || fprintf(f, "%llu\n", (unsigned long long)nentries) < 0 || fclose(f) != 0) fail("Failed to write", countfile);
+	return nentries;
+}
+
+// --- Running ---
+
+static bool candrop = true;
+
+// Drops the page cache, dentries and inodes, needs root
+static bool drop_caches(void) {
+	if (!candrop) return false;
+	sync();
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd == -1 || write(fd, "3", 1) != 1) {
+		perror("Can't drop caches, skipping cold runs");
+		candrop = false;
+	}
+	if (fd != -1) close(fd);
+	return candrop;
+}
+
+// Runs the command with the root as its last argument and output thrown away. If syscalls isn't NULL, the run
+// is traced and every syscall entry of every thread counted. Returns false if the command failed.
+static bool run(char **argv, int argc, const char *root, double *wall, long *maxrss, uint64_t *syscalls) {
+	argv[argc] = (char*)root;
+	argv[argc + 1] = NULL;
+	struct timespec start, end;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) < 0) { perror("Failed to get time"); exit(1); }
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("Failed to fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null == -1 || dup2(null, STDOUT_FILENO) == -1 || dup2(null, STDERR_FILENO) == -1) _exit(127);
+		if (syscalls != NULL) {
+			if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) _exit(127);
+			raise(SIGSTOP); // let the parent set options before exec
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	int status;
+	struct rusage ru;
+	if (syscalls != NULL) {
+		*syscalls = 0;
+		if (waitpid(pid, &status, 0) == -1 || ptrace(PTRACE_SETOPTIONS, pid, NULL,
+				PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL) == -1) {
+			perror("Failed to trace command");
+			exit(1);
+		}
+		ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+		pid_t tid;
+		// Stops of all threads, until the main one is gone
+		while ((tid = wait4(-1, &status, __WALL, &ru)) != -1) {
+			if (WIFEXITED(status) || WIFSIGNALED(status)) {
+				if (tid == pid) break;
+				continue;
+			}
+			int sig = 0;
+			if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+				struct ptrace_syscall_info info;
+				if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+					(*syscalls)++;
+			} else if (status >> 16 == 0 && WSTOPSIG(status) != SIGSTOP && WSTOPSIG(status) != SIGTRAP) {
+				sig = WSTOPSIG(status); // a real signal, pass it on
+			}
+			ptrace(PTRACE_SYSCALL, tid, NULL, sig);
+		}
+	} else if (wait4(pid, &status, 0, &ru) == -1) {
+		perror("Failed to wait for command");
+		exit(1);
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &end) < 0) { perror("Failed to get time"); exit(1); }
+	*wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	*maxrss = ru.ru_maxrss;
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		printf("Usage: %s <tree directory> <walker command>...\n", argc > 0 ? argv[0] : "dir-bench");
+		printf("  Generates the synthetic trees in the directory if they aren't there yet, then runs every command\n");
+		printf("  (split on spaces, the tree is appended) over each of them and prints CSV\n");
+		exit(2);
+	}
+	const char *dir = argv[1];
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) fail("Failed to create directory", dir);
+
+	printf("tree,walker,cache,run,entries,wall_s,entries_per_s,syscalls_per_entry,peak_rss_kib\n");
+	for (size_t t = 0; t < sizeof(trees) / sizeof(trees[0]); t++) {
+		uint64_t entries = make_tree(dir, &trees[t]);
+		char root[PATH_MAX];
+		snprintf(root, sizeof(root), "%s/%s", dir, trees[t].name);
+		for (int c = 2; c < argc; c++) {
+			char cmd[256], *args[MAX_ARGS + 2];
+			int nargs = 0;
+			snprintf(cmd, sizeof(cmd), "%s", argv[c]);
+			for (char *tok = strtok(cmd, " "); tok != NULL && nargs < MAX_ARGS; tok = strtok(NULL, " ")) args[nargs++] = tok;
+			if (nargs == 0) continue;
+			double wall;
+			long maxrss;
+			uint64_t syscalls;
+			if (!run(args, nargs, root, &wall, &maxrss, NULL)) { // warm up, and check it works at all
+				fprintf(stderr, "'%s' failed on the %s tree, skipping it\n", argv[c], trees[t].name);
+				continue;
+			}
+			run(args, nargs, root, &wall, &maxrss, &syscalls);
+			for (int cold = 1; cold >= 0; cold--) {
+				for (int r = 0; r < BENCH_RUNS; r++) {
+					if (cold && !drop_caches()) break;
+					run(args, nargs, root, &wall, &maxrss, NULL);
+					printf("%s,%s,%s,%d,%llu,%.4f,%.0f,%.2f,%ld\n", trees[t].name, argv[c], cold ? "cold" : "warm", r + 1,
+							(unsigned long long)entries, wall, entries / wall, (double)syscalls / entries, maxrss);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	return 0;
+}
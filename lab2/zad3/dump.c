@@ -0,0 +1,63 @@
+// Mateusz Naściszewski, 2022
+// Prints a binary listing written by `main-dir -b` in the text format of main-dir, as an example of libdircol
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libdircol.h"
+
+static void print_time(int64_t t, char end) {
+	char timebuf[32];
+	struct tm tmbuf;
+	time_t tt = t;
+	if (gmtime_r(&tt, &tmbuf) != NULL) {
+		strftime(timebuf, sizeof(timebuf), "%F %T", &tmbuf);
+		printf("%s%c", timebuf, end);
+	} else {
+		printf("???%c", end);
+	}
+}
+
+static const char* type_desc(uint32_t mode) {
+	switch (mode & S_IFMT) {
+		case S_IFSOCK:return "sock";
+		case S_IFLNK: return "syml";
+		case S_IFREG: return "file";
+		case S_IFBLK: return "bdev";
+		case S_IFDIR: return "dir ";
+		case S_IFCHR: return "cdev";
+		case S_IFIFO: return "fifo";
+		default:      return "????";
+	}
+}
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		printf("Usage: %s <binary listing>\n", argc > 0 ? argv[0] : "dircol-dump");
+		exit(2);
+	}
+	libdircol db;
+	if (!libdircol_open(&db, argv[1])) {
+		perror("Could not open listing");
+		exit(1);
+	}
+	libdircol_iter it;
+	libdircol_iter_init(&it, &db);
+	uint64_t total = 0;
+	for (uint64_t i = 0; i < db.count; i++) {
+		const char *path = libdircol_path(&it, i);
+		if (path == NULL) {
+			fprintf(stderr, "Listing is corrupt at entry %lu\n", i);
+			exit(1);
+		}
+		printf("%s\t%lu\t%s\t%ld\t", path, db.nlink[i], type_desc(db.mode[i]), db.size[i]);
+		print_time(db.atime[i], '\t');
+		print_time(db.mtime[i], '\n');
+		total += db.size[i]; // aggregations read the columns directly
+	}
+	fprintf(stderr, "%lu entries, %lu bytes\n", db.count, total);
+	libdircol_iter_free(&it);
+	libdircol_close(&db);
+	return 0;
+}
@@ -0,0 +1,147 @@
+// Mateusz Naściszewski, 2022
+
+#include <stdbool.h> // bool
+#include <stdint.h> // (u)intX_t
+#include <stdlib.h> // realloc, free
+#include <string.h> // memcpy, memcmp
+#include <errno.h> // errno
+#include <fcntl.h> // open
+#include <unistd.h> // close
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+
+#include "libdircol.h"
+
+// Checks that a section of n items of the given size lies within the file
+static bool section_ok(const libdircol *db, uint64_t off, uint64_t n, size_t size) {
+	return off % 8 == 0 && off <= db->mapsize && n <= (db->mapsize - off) / size;
+}
+
+bool libdircol_open(libdircol *db, const char *file) {
+	int fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return false;
+	struct stat sb;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return false;
+	}
+	if ((size_t)sb.st_size < sizeof(struct libdircol_header)) {
+		close(fd);
+		errno = EINVAL;
+		return false;
+	}
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	const struct libdircol_header *hdr = map;
+	db->hdr = hdr;
+	db->mapsize = sb.st_size;
+	db->count = hdr->count;
+	if (memcmp(hdr->magic, LIBDIRCOL_MAGIC, sizeof(hdr->magic)) != 0
+			|| !section_ok(db, hdr->mode_off, hdr->count, sizeof(uint32_t))
+			|| !section_ok(db, hdr->nlink_off, hdr->count, sizeof(uint64_t))
+			|| !section_ok(db, hdr->size_off, hdr->count, sizeof(int64_t))
+			|| !section_ok(db, hdr->atime_off, hdr->count, sizeof(int64_t))
+			|| !section_ok(db, hdr->mtime_off, hdr->count, sizeof(int64_t))
+			|| !section_ok(db, hdr->restarts_off, hdr->nrestarts, sizeof(struct libdircol_restart))
+			|| !section_ok(db, hdr->paths_off, hdr->paths_size, 1)
+			|| (hdr->count > 0 && (hdr->nrestarts == 0 || ((const struct libdircol_restart*)((const char*)map + hdr->restarts_off))->index != 0))) {
+		munmap(map, sb.st_size);
+		errno = EINVAL;
+		return false;
+	}
+	const char *base = map;
+	db->mode = (const uint32_t*)(base + hdr->mode_off);
+	db->nlink = (const uint64_t*)(base + hdr->nlink_off);
+	db->size = (const int64_t*)(base + hdr->size_off);
+	db->atime = (const int64_t*)(base + hdr->atime_off);
+	db->mtime = (const int64_t*)(base + hdr->mtime_off);
+	db->restarts = (const struct libdircol_restart*)(base + hdr->restarts_off);
+	db->paths = (const uint8_t*)(base + hdr->paths_off);
+	return true;
+}
+
+void libdircol_close(libdircol *db) {
+	munmap((void*)db->hdr, db->mapsize);
+	db->hdr = NULL;
+}
+
+void libdircol_iter_init(libdircol_iter *it, const libdircol *db) {
+	it->db = db;
+	it->index = db->count;
+	it->next = NULL;
+	it->path = NULL;
+	it->len = it->cap = 0;
+}
+
+void libdircol_iter_free(libdircol_iter *it) {
+	free(it->path);
+	it->path = NULL;
+	it->len = it->cap = 0;
+}
+
+// Returns false at the end of the path data
+static bool read_varint(const libdircol *db, const uint8_t **p, uint64_t *val) {
+	const uint8_t *end = db->paths + db->hdr->paths_size;
+	*val = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*p >= end) return false;
+		uint8_t b = *(*p)++;
+		*val |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+// Decodes the record at it->next as the path after the current one
+static bool decode_next(libdircol_iter *it) {
+	const libdircol *db = it->db;
+	const uint8_t *p = it->next;
+	uint64_t shared, rest;
+	if (!read_varint(db, &p, &shared) || !read_varint(db, &p, &rest)) return false;
+	if (shared > it->len || rest > (uint64_t)(db->paths + db->hdr->paths_size - p)) return false;
+	if (shared + rest + 1 > it->cap) {
+		size_t cap = it->cap ? it->cap : 256;
+		while (cap < shared + rest + 1) cap *= 2;
+		char *path = realloc(it->path, cap);
+		if (path == NULL) return false;
+		it->path = path;
+		it->cap = cap;
+	}
+	memcpy(it->path + shared, p, rest);
+	it->len = shared + rest;
+	it->path[it->len] = '\0';
+	it->next = p + rest;
+	return true;
+}
+
+const char* libdircol_path(libdircol_iter *it, uint64_t i) {
+	const libdircol *db = it->db;
+	if (i >= db->count) return NULL;
+	if (it->index == i) return it->path;
+	// Closest restart point at or before i
+	uint64_t lo = 0, hi = db->hdr->nrestarts;
+	while (hi - lo > 1) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (db->restarts[mid].index <= i) lo = mid;
+		else hi = mid;
+	}
+	// Carry on from the current path if it's closer
+	if (it->index >= db->count || it->index > i || it->index < db->restarts[lo].index) {
+		it->index = db->count;
+		if (db->restarts[lo].offset >= db->hdr->paths_size) return NULL;
+		it->next = db->paths + db->restarts[lo].offset;
+		it->len = 0;
+		if (!decode_next(it)) return NULL;
+		it->index = db->restarts[lo].index;
+	}
+	while (it->index < i) {
+		if (!decode_next(it)) {
+			it->index = db->count;
+			return NULL;
+		}
+		it->index++;
+	}
+	return it->path;
+}
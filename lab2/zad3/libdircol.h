@@ -0,0 +1,71 @@
+// Mateusz Naściszewski, 2022
+
+#pragma once
+
+#include <stdbool.h> // bool
+#include <stdint.h> // (u)intX_t
+#include <stddef.h> // size_t
+
+// --- File format ---
+// Columnar listing written by `main-dir -b`, native byte order, every section 8-byte aligned:
+//   struct libdircol_header
+//   uint32_t mode[count]
+//   uint64_t nlink[count]
+//   int64_t size[count], atime[count], mtime[count]
+//   struct libdircol_restart restarts[nrestarts]
+//   path data
+// Paths are front-coded: each is a varint (LEB128) of how many bytes it shares with the previous path, a varint
+// of the length of the rest, and the rest. Restart points store the whole path, so decoding can start there.
+
+#define LIBDIRCOL_MAGIC "DIRCOL\0\1"
+
+struct libdircol_header {
+	char magic[8];
+	uint64_t count;
+	uint64_t mode_off, nlink_off, size_off, atime_off, mtime_off;
+	uint64_t restarts_off, nrestarts;
+	uint64_t paths_off, paths_size;
+};
+
+struct libdircol_restart {
+	uint64_t index;  // entry stored whole
+	uint64_t offset; // of its record in the path data
+};
+
+// --- Reading ---
+
+typedef struct libdircol {
+	const struct libdircol_header *hdr;
+	size_t mapsize;
+	uint64_t count;
+	// Columns, count entries each
+	const uint32_t *mode;
+	const uint64_t *nlink;
+	const int64_t *size;
+	const int64_t *atime;
+	const int64_t *mtime;
+	// Used by libdircol_path
+	const struct libdircol_restart *restarts;
+	const uint8_t *paths;
+} libdircol;
+
+// Decodes paths, one after another or at random. Owns the buffer of the current path.
+typedef struct libdircol_iter {
+	const libdircol *db;
+	uint64_t index;      // of the current path, count if there is none yet
+	const uint8_t *next; // record of the path after it
+	char *path;
+	size_t len, cap;
+} libdircol_iter;
+
+// Maps the file. Returns false with errno set if it can't be mapped, or EINVAL if it isn't a valid listing.
+bool libdircol_open(libdircol *db, const char *file);
+void libdircol_close(libdircol *db);
+
+void libdircol_iter_init(libdircol_iter *it, const libdircol *db);
+void libdircol_iter_free(libdircol_iter *it);
+
+// Returns path number i, or NULL if there is no such entry or the data is corrupt.
+// Walking the entries in order decodes each path once, other jumps start from the closest restart point.
+// Lifetime note: the string is owned by the iterator and only valid until the next call.
+const char* libdircol_path(libdircol_iter *it, uint64_t i);
@@ -2,10 +2,15 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <limits.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
+#include "libdircol.h"
+
 #ifdef NFTW
 #define PROGNAME "main-nftw"
 #include <ftw.h>
@@ -13,15 +18,27 @@
 static int nftw_func(const char *fpath, const struct stat *sb, int type, struct FTW *ftwbuf);
 #else
 #define PROGNAME "main-dir"
-#include <stdbool.h>
-#include <string.h>
 #include <assert.h>
 #include <dirent.h>
-#include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h> // makedev
+#include <linux/io_uring.h>
 #endif
 
+#define OUTBUF_FLUSH (1 << 20) // output is written out in chunks of at least this size
+#define RESTART_INTERVAL 64 // -b: paths stored whole, for random access
+#define DIRBUF_SIZE (1 << 20) // getdents64() buffer of the parallel walker, big directories are read in a few calls
+#define HEAD_SIZE 4096 // -H: duplicate candidates are compared by a hash of this much first
+#define HASHBUF_SIZE (1 << 17)
+
 static struct stats {
 	unsigned n_file;
 	unsigned n_dir;
@@ -35,54 +52,578 @@ static struct stats {
 	uint64_t total_bytes;
 } stats;
 
-static void report(const char *fpath, const struct stat *sb) {
-	static char timebuf[32];
-	struct tm *time;
-	char *desc = "????";
+// -L: symbolic links are followed, entries show up as what they point to, dangling links as themselves.
+// A directory reached again, through another link or a loop, is left out altogether, so every one is listed
+// and walked once. main-dir remembers them by (dev, ino) in a hash set, nftw() keeps a set of its own. With
+// several threads, which of the paths to a directory gets it depends on timing.
+static bool follow;
+
+// Growable output buffer, each walker thread fills its own and writes it out in one go.
+// Formatting timestamps is most of the work per line, and neighbouring files tend to share them,
+// so the last formatted date and timestamp are kept.
+struct outbuf {
+	size_t cap;
+	size_t len;
+	char *data;
+	struct columns *cols; // -b: entries go here instead
+	struct topk *top;     // -T: or only the top ones are kept here
+	bool havedate, havetime;
+	int64_t day;     // days since the epoch of date
+	char date[11];   // "YYYY-MM-DD "
+	time_t time;
+	char timestr[19];
+};
+
+static struct outbuf out;
+
+static void ob_reserve(struct outbuf *ob, size_t n) {
+	if (ob->cap - ob->len >= n) return;
+	while (ob->cap - ob->len < n) ob->cap = ob->cap ? ob->cap * 2 : 2 * OUTBUF_FLUSH;
+	ob->data = realloc(ob->data, ob->cap);
+	if (ob->data == NULL) {
+		fprintf(stderr, "Output buffer allocation failed\n");
+		exit(65);
+	}
+}
+
+static void ob_putn(struct outbuf *ob, const char *s, size_t n) {
+	ob_reserve(ob, n);
+	memcpy(ob->data + ob->len, s, n);
+	ob->len += n;
+}
+
+static void ob_puts(struct outbuf *ob, const char *s) {
+	ob_putn(ob, s, strlen(s));
+}
+
+static void ob_putc(struct outbuf *ob, char c) {
+	ob_reserve(ob, 1);
+	ob->data[ob->len++] = c;
+}
+
+static void ob_putu(struct outbuf *ob, uint64_t val) {
+	char digits[20];
+	char *p = digits + sizeof(digits);
+	do {
+		*--p = '0' + val % 10;
+		val /= 10;
+	} while (val > 0);
+	ob_putn(ob, p, digits + sizeof(digits) - p);
+}
+
+static void ob_puti(struct outbuf *ob, int64_t val) {
+	if (val < 0) {
+		ob_putc(ob, '-');
+		ob_putu(ob, -(uint64_t)val);
+	} else {
+		ob_putu(ob, val);
+	}
+}
+
+static void put2(char *p, unsigned val) {
+	p[0] = '0' + val / 10;
+	p[1] = '0' + val % 10;
+}
+
+// Same as strftime() with "%F %T" of gmtime(), "???" if that fails
+static void ob_puttime(struct outbuf *ob, time_t t) {
+	// Years 1000-9999, where %Y is always 4 digits
+	if (t >= -30610224000 && t <= 253402300799) {
+		if (!ob->havetime || ob->time != t) {
+			int64_t day = t >= 0 ? t / 86400 : -((-t + 86399) / 86400);
+			unsigned secs = t - day * 86400;
+			if (!ob->havedate || ob->day != day) {
+				// Civil date from days since the epoch, see http://howardhinnant.github.io/date_algorithms.html
+				int64_t z = day + 719468;
+				int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+				unsigned doe = z - era * 146097;
+				unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+				unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+				unsigned mp = (5 * doy + 2) / 153;
+				unsigned d = doy - (153 * mp + 2) / 5 + 1;
+				unsigned m = mp < 10 ? mp + 3 : mp - 9;
+				unsigned y = yoe + era * 400 + (m <= 2);
+				put2(ob->date, y / 100);
+				put2(ob->date + 2, y % 100);
+				ob->date[4] = '-';
+				put2(ob->date + 5, m);
+				ob->date[7] = '-';
+				put2(ob->date + 8, d);
+				ob->date[10] = ' ';
+				ob->day = day;
+				ob->havedate = true;
+			}
+			memcpy(ob->timestr, ob->date, sizeof(ob->date));
+			put2(ob->timestr + 11, secs / 3600);
+			ob->timestr[13] = ':';
+			put2(ob->timestr + 14, secs / 60 % 60);
+			ob->timestr[16] = ':';
+			put2(ob->timestr + 17, secs % 60);
+			ob->time = t;
+			ob->havetime = true;
+		}
+		ob_putn(ob, ob->timestr, sizeof(ob->timestr));
+		return;
+	}
+	char timebuf[32];
+	struct tm tmbuf;
+	if (gmtime_r(&t, &tmbuf) != NULL) {
+		strftime(timebuf, sizeof(timebuf), "%F %T", &tmbuf);
+		ob_puts(ob, timebuf);
+	} else {
+		ob_puts(ob, "???");
+	}
+}
+
+// Line for an entry that couldn't be stat()ed
+static void ob_putfailed(struct outbuf *ob, const char *fpath) {
+	if (ob->cols != NULL || ob->top != NULL) return; // only counted
+	ob_puts(ob, fpath);
+	ob_puts(ob, "\t?\t????\t?\t???\t???\n");
+}
+
+static void ob_flush(struct outbuf *ob) {
+	for (size_t done = 0; done < ob->len; ) {
+		ssize_t written = write(STDOUT_FILENO, ob->data + done, ob->len - done);
+		if (written == -1) {
+			perror("Write failed");
+			exit(1);
+		}
+		done += written;
+	}
+	ob->len = 0;
+}
+
+// -b: binary listing, see libdircol.h. Every thread collects its entries as columns with front-coded paths,
+// which are concatenated when the walk is done.
+struct columns {
+	size_t count, cap;
+	uint32_t *mode;
+	uint64_t *nlink;
+	int64_t *size, *atime, *mtime;
+	struct outbuf paths;
+	struct libdircol_restart *restarts; // indexes and offsets within this part
+	size_t nrestarts, caprestarts;
+	char *prev;
+	size_t prevlen, prevcap;
+};
+
+static void ob_putvarint(struct outbuf *ob, uint64_t val) {
+	for (; val >= 0x80; val >>= 7) ob_putc(ob, (val & 0x7f) | 0x80);
+	ob_putc(ob, val);
+}
+
+static void col_add(struct columns *c, const char *fpath, const struct stat *sb) {
+	if (c->count == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 1024;
+		c->mode = realloc(c->mode, c->cap * sizeof(uint32_t));
+		c->nlink = realloc(c->nlink, c->cap * sizeof(uint64_t));
+		c->size = realloc(c->size, c->cap * sizeof(int64_t));
+		c->atime = realloc(c->atime, c->cap * sizeof(int64_t));
+		c->mtime = realloc(c->mtime, c->cap * sizeof(int64_t));
+		if (c->mode == NULL || c->nlink == NULL || c->size == NULL || c->atime == NULL || c->mtime == NULL) {
+			fprintf(stderr, "Column allocation failed\n");
+			exit(65);
+		}
+	}
+	c->mode[c->count] = sb->st_mode;
+	c->nlink[c->count] = sb->st_nlink;
+	c->size[c->count] = sb->st_size;
+	c->atime[c->count] = sb->st_atime;
+	c->mtime[c->count] = sb->st_mtime;
+
+	size_t len = strlen(fpath), shared = 0;
+	if (c->count % RESTART_INTERVAL == 0) {
+		if (c->nrestarts == c->caprestarts) {
+			c->caprestarts = c->caprestarts ? c->caprestarts * 2 : 64;
+			c->restarts = realloc(c->restarts, c->caprestarts * sizeof(struct libdircol_restart));
+			if (c->restarts == NULL) {
+				fprintf(stderr, "Column allocation failed\n");
+				exit(65);
+			}
+		}
+		c->restarts[c->nrestarts++] = (struct libdircol_restart) { .index = c->count, .offset = c->paths.len };
+	} else {
+		while (shared < len && shared < c->prevlen && fpath[shared] == c->prev[shared]) shared++;
+	}
+	ob_putvarint(&c->paths, shared);
+	ob_putvarint(&c->paths, len - shared);
+	ob_putn(&c->paths, fpath + shared, len - shared);
+	if (len + 1 > c->prevcap) {
+		c->prevcap = 2 * (len + 1);
+		c->prev = realloc(c->prev, c->prevcap);
+		if (c->prev == NULL) {
+			fprintf(stderr, "String allocation failed\n");
+			exit(65);
+		}
+	}
+	memcpy(c->prev, fpath, len);
+	c->prevlen = len;
+	c->count++;
+}
+
+static const char* type_desc(mode_t mode) {
+	switch (mode & S_IFMT) {
+		case S_IFSOCK:return "sock";
+		case S_IFLNK: return "syml";
+		case S_IFREG: return "file";
+		case S_IFBLK: return "bdev";
+		case S_IFDIR: return "dir ";
+		case S_IFCHR: return "cdev";
+		case S_IFIFO: return "fifo";
+		default:      return "????";
+	}
+}
+
+// Returns false for an unknown file type, which counts as a failure
+static bool count_entry(struct stats *st, const char *fpath, const struct stat *sb) {
 	switch (sb->st_mode & S_IFMT) {
-		case S_IFSOCK:desc = "sock"; stats.n_sock++; break;
-		case S_IFLNK: desc = "syml"; stats.n_sym++; break;
-		case S_IFREG: desc = "file"; stats.n_file++; break;
-		case S_IFBLK: desc = "bdev"; stats.n_blk++; break;
-		case S_IFDIR: desc = "dir "; stats.n_dir++; break;
-		case S_IFCHR: desc = "cdev"; stats.n_char++; break;
-		case S_IFIFO: desc = "fifo"; stats.n_fifo++; break;
+		case S_IFSOCK:st->n_sock++; break;
+		case S_IFLNK: st->n_sym++; break;
+		case S_IFREG: st->n_file++; break;
+		case S_IFBLK: st->n_blk++; break;
+		case S_IFDIR: st->n_dir++; break;
+		case S_IFCHR: st->n_char++; break;
+		case S_IFIFO: st->n_fifo++; break;
 		default:
 			fprintf(stderr, "Error: %s\nunknown mode: %07o\n", fpath, sb->st_mode);
-			stats.n_fail++;
+			st->n_fail++;
+			return false;
+	}
+	st->total_bytes += sb->st_size;
+	return true;
+}
+
+static void put_line(struct outbuf *ob, const char *fpath, const struct stat *sb) {
+	ob_puts(ob, fpath);
+	ob_putc(ob, '\t');
+	ob_putu(ob, sb->st_nlink);
+	ob_putc(ob, '\t');
+	ob_putn(ob, type_desc(sb->st_mode), 4);
+	ob_putc(ob, '\t');
+	ob_puti(ob, sb->st_size);
+	ob_putc(ob, '\t');
+	ob_puttime(ob, sb->st_atime);
+	ob_putc(ob, '\t');
+	ob_puttime(ob, sb->st_mtime);
+	ob_putc(ob, '\n');
+}
+
+// Extended summary (-e): a histogram of regular file sizes by their bit length, so bucket k holds sizes in
+// [2^(k-1), 2^k) and bucket 0 empty files, and the number and bytes of regular files per extension. The
+// extensions live in a hash table with open addressing, its entries are carved out of big arena chunks, one
+// allocation per 64 KiB instead of one per extension. Each walker thread fills its own, they are merged at the end.
+enum { EXT_NONE, EXT_TEXT, EXT_JSON };
+static int extended; // -e
+#define ARENA_CHUNK (1 << 16)
+#define SIZE_BUCKETS 65
+
+struct arenachunk {
+	struct arenachunk *prev;
+	char data[];
+};
+
+struct arena {
+	struct arenachunk *last;
+	size_t used, size; // of the last chunk
+};
+
+struct extcount {
+	uint64_t hash;
+	uint64_t files, bytes;
+	size_t len;
+	char name[];       // not terminated
+};
+
+struct extstats {
+	uint64_t sizes[SIZE_BUCKETS];
+	struct extcount **slots;
+	size_t cap, n;
+	struct arena arena;
+};
+
+static struct extstats ext;
+
+static void *arena_alloc(struct arena *a, size_t n) {
+	n = (n + 7) & ~(size_t)7;
+	if (a->last == NULL || a->size - a->used < n) {
+		size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+		struct arenachunk *c = malloc(sizeof(struct arenachunk) + size);
+		if (c == NULL) {
+			fprintf(stderr, "Arena allocation failed\n");
+			exit(65);
+		}
+		c->prev = a->last;
+		a->last = c;
+		a->used = 0;
+		a->size = size;
+	}
+	void *p = a->last->data + a->used;
+	a->used += n;
+	return p;
+}
+
+static void arena_free(struct arena *a) {
+	for (struct arenachunk *c = a->last, *prev; c != NULL; c = prev) {
+		prev = c->prev;
+		free(c);
+	}
+	a->last = NULL;
+}
+
+static void ext_count(struct extstats *e, const char *name, size_t len, uint64_t files, uint64_t bytes) {
+	uint64_t h = 0xcbf29ce484222325u; // FNV-1a
+	for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 0x100000001b3u;
+	if (2 * (e->n + 1) > e->cap) {
+		size_t cap = e->cap ? e->cap * 2 : 256;
+		struct extcount **slots = calloc(cap, sizeof(struct extcount*));
+		if (slots == NULL) {
+			fprintf(stderr, "Extension table allocation failed\n");
+			exit(65);
+		}
+		for (size_t i = 0; i < e->cap; i++) {
+			if (e->slots[i] == NULL) continue;
+			size_t j = e->slots[i]->hash & (cap - 1);
+			while (slots[j] != NULL) j = (j + 1) & (cap - 1);
+			slots[j] = e->slots[i];
+		}
+		free(e->slots);
+		e->slots = slots;
+		e->cap = cap;
+	}
+	size_t j = h & (e->cap - 1);
+	for (; e->slots[j] != NULL; j = (j + 1) & (e->cap - 1)) {
+		struct extcount *c = e->slots[j];
+		if (c->hash == h && c->len == len && memcmp(c->name, name, len) == 0) {
+			c->files += files;
+			c->bytes += bytes;
 			return;
+		}
 	}
-	printf("%s\t%lu\t%s\t%ld\t", fpath, sb->st_nlink, desc, sb->st_size);
-	stats.total_bytes += sb->st_size;
-	time = gmtime(&sb->st_atime);
-	if (time != NULL) {
-		strftime(timebuf, sizeof(timebuf), "%F %T", time);
-		printf("%s\t", timebuf);
-	} else {
-		printf("???\t");
+	struct extcount *c = arena_alloc(&e->arena, sizeof(struct extcount) + len);
+	*c = (struct extcount){ .hash = h, .files = files, .bytes = bytes, .len = len };
+	memcpy(c->name, name, len);
+	e->slots[j] = c;
+	e->n++;
+}
+
+static void ext_add(struct extstats *e, const char *fpath, const struct stat *sb) {
+	if (!S_ISREG(sb->st_mode)) return;
+	uint64_t size = sb->st_size;
+	e->sizes[size == 0 ? 0 : 64 - __builtin_clzll(size)]++;
+	const char *base = strrchr(fpath, '/');
+	base = base != NULL ? base + 1 : fpath;
+	const char *dot = strrchr(base, '.');
+	if (dot == NULL || dot == base) dot = base + strlen(base); // no extension, or a hidden file
+	else dot++;
+	ext_count(e, dot, strlen(dot), 1, size);
+}
+
+static int cmp_extcounts(const void *_a, const void *_b) {
+	const struct extcount *a = *(struct extcount* const*)_a, *b = *(struct extcount* const*)_b;
+	if (a->bytes != b->bytes) return a->bytes < b->bytes ? 1 : -1;
+	size_t n = a->len < b->len ? a->len : b->len;
+	int c = memcmp(a->name, b->name, n);
+	return c != 0 ? c : a->len < b->len ? -1 : a->len > b->len;
+}
+
+// Length of the well-formed UTF-8 sequence at s, 0 if there is none
+static size_t utf8_len(const unsigned char *s, size_t left) {
+	if (s[0] < 0x80) return 1;
+	size_t n = s[0] >= 0xc2 && s[0] <= 0xdf ? 2 : s[0] >= 0xe0 && s[0] <= 0xef ? 3 : s[0] >= 0xf0 && s[0] <= 0xf4 ? 4 : 0;
+	if (n == 0 || n > left) return 0;
+	for (size_t i = 1; i < n; i++) {
+		if ((s[i] & 0xc0) != 0x80) return 0;
+	}
+	// Overlong forms, UTF-16 surrogates and anything above U+10FFFF
+	if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0) || (s[0] == 0xf0 && s[1] < 0x90) || (s[0] == 0xf4 && s[1] >= 0x90)) return 0;
+	return n;
+}
+
+// Prints the buckets from the first to the last used one, then the extensions by bytes, largest first.
+// JSON output also carries the usual totals and the -H duplicates if dups isn't NULL, it replaces the whole summary.
+static void ext_print(const struct stats *st, struct extstats *e, int format, const uint64_t *dups) {
+	int first = 0, last = -1;
+	for (int k = 0; k < SIZE_BUCKETS; k++) {
+		if (e->sizes[k] == 0) continue;
+		if (last == -1) first = k;
+		last = k;
 	}
-	time = gmtime(&sb->st_mtime);
-	if (time != NULL) {
-		strftime(timebuf, sizeof(timebuf), "%F %T", time);
-		printf("%s\n", timebuf);
+	size_t n = 0;
+	for (size_t i = 0; i < e->cap; i++) {
+		if (e->slots[i] != NULL) e->slots[n++] = e->slots[i];
+	}
+	qsort(e->slots, n, sizeof(struct extcount*), cmp_extcounts);
+	if (format == EXT_TEXT) {
+		printf("\nFile sizes:\n");
+		for (int k = first; k <= last; k++) {
+			if (k == 0) printf("  %20s  %lu\n", "0", e->sizes[k]);
+			else printf("  %9lu - %-9lu %lu\n", 1ul << (k - 1), k == 64 ? UINT64_MAX : (1ul << k) - 1, e->sizes[k]);
+		}
+		printf("\nExtensions:           files            bytes\n");
+		for (size_t i = 0; i < n; i++) {
+			const struct extcount *c = e->slots[i];
+			if (c->len == 0) printf("  %-16s", "(none)");
+			else printf("  .%-15.*s", (int)c->len, c->name);
+			printf(" %9lu %16lu\n", c->files, c->bytes);
+		}
 	} else {
-		printf("???\n");
+		printf("{\"files\": %u, \"dirs\": %u, \"char_devs\": %u, \"block_devs\": %u, \"fifos\": %u, \"symlinks\": %u, "
+				"\"sockets\": %u, \"failed\": %u, \"bytes_total\": %lu,\n", st->n_file, st->n_dir, st->n_char, st->n_blk,
+				st->n_fifo, st->n_sym, st->n_sock, st->n_fail, st->total_bytes);
+		if (dups != NULL) printf(" \"duplicates\": %lu,\n", *dups);
+		printf(" \"file_sizes\": [");
+		for (int k = first; k <= last; k++) {
+			printf("%s\n  {\"min\": %lu, \"max\": %lu, \"files\": %lu}", k > first ? "," : "", k == 0 ? 0 : 1ul << (k - 1),
+					k == 0 ? 0 : k == 64 ? UINT64_MAX : (1ul << k) - 1, e->sizes[k]);
+		}
+		printf("],\n \"extensions\": [");
+		for (size_t i = 0; i < n; i++) {
+			const struct extcount *c = e->slots[i];
+			printf("%s\n  {\"extension\": \"", i > 0 ? "," : "");
+			for (size_t j = 0, n; j < c->len; j += n) {
+				unsigned char ch = c->name[j];
+				n = utf8_len((const unsigned char*)c->name + j, c->len - j);
+				if (n == 0) { // not UTF-8, JSON can't carry it
+					printf("\\ufffd");
+					n = 1;
+				} else if (ch == '"' || ch == '\\') {
+					printf("\\%c", ch);
+				} else if (ch < 0x20) {
+					printf("\\u%04x", ch);
+				} else {
+					fwrite(c->name + j, 1, n, stdout);
+				}
+			}
+			printf("\", \"files\": %lu, \"bytes\": %lu}", c->files, c->bytes);
+		}
+		printf("]}\n");
+	}
+	free(e->slots);
+	arena_free(&e->arena);
+}
+
+// Top entries (-T, -k): only the K largest, newest or most recently accessed entries are printed, largest first.
+// They are kept in a min-heap of K entries with the smallest at the root, so most entries are rejected by
+// a single comparison. Each walker thread has its own heap, they are merged at the end. Directories aren't ranked.
+enum { KEY_SIZE, KEY_MTIME, KEY_ATIME };
+static long topcount; // -T, 0 if off
+static int topkey;    // -k
+
+struct topentry {
+	int64_t key;
+	char *path;
+	struct stat sb;
+};
+
+struct topk {
+	struct topentry *e; // topcount slots
+	size_t n;
+};
+
+static struct topk top;
+
+// Ties go to the path that sorts first, so the result doesn't depend on the order of the walk
+static bool top_less(const struct topentry *a, int64_t key, const char *path) {
+	return a->key < key || (a->key == key && strcmp(a->path, path) > 0);
+}
+
+static void top_down(struct topk *t, size_t i) {
+	while (true) {
+		size_t min = i, l = 2 * i + 1, r = l + 1;
+		if (l < t->n && top_less(&t->e[l], t->e[min].key, t->e[min].path)) min = l;
+		if (r < t->n && top_less(&t->e[r], t->e[min].key, t->e[min].path)) min = r;
+		if (min == i) return;
+		struct topentry tmp = t->e[i];
+		t->e[i] = t->e[min];
+		t->e[min] = tmp;
+		i = min;
+	}
+}
+
+// Takes over path
+static void top_insert(struct topk *t, int64_t key, char *path, const struct stat *sb) {
+	if (t->e == NULL) {
+		t->e = malloc(topcount * sizeof(struct topentry));
+		if (t->e == NULL) {
+			fprintf(stderr, "Top entry allocation failed\n");
+			exit(65);
+		}
+	}
+	if (t->n == (size_t)topcount) {
+		free(t->e[0].path);
+		t->e[0] = (struct topentry){ key, path, *sb };
+		top_down(t, 0);
+		return;
+	}
+	size_t i = t->n++;
+	t->e[i] = (struct topentry){ key, path, *sb };
+	for (; i > 0 && top_less(&t->e[i], t->e[(i - 1) / 2].key, t->e[(i - 1) / 2].path); i = (i - 1) / 2) {
+		struct topentry tmp = t->e[i];
+		t->e[i] = t->e[(i - 1) / 2];
+		t->e[(i - 1) / 2] = tmp;
+	}
+}
+
+static void top_add(struct topk *t, const char *fpath, const struct stat *sb) {
+	if (S_ISDIR(sb->st_mode)) return;
+	int64_t key = topkey == KEY_SIZE ? sb->st_size : topkey == KEY_MTIME ? sb->st_mtime : sb->st_atime;
+	if (t->n == (size_t)topcount && !top_less(&t->e[0], key, fpath)) return;
+	char *copy = strdup(fpath);
+	if (copy == NULL) {
+		fprintf(stderr, "String allocation failed\n");
+		exit(65);
 	}
+	top_insert(t, key, copy, sb);
+}
+
+static int cmp_topentries(const void *_a, const void *_b) {
+	const struct topentry *a = _a, *b = _b;
+	return a->key < b->key ? 1 : a->key > b->key ? -1 : strcmp(a->path, b->path);
+}
+
+// Lines of the top entries, largest first
+static void top_print(struct topk *t) {
+	qsort(t->e, t->n, sizeof(struct topentry), cmp_topentries);
+	for (size_t i = 0; i < t->n; i++) {
+		put_line(&out, t->e[i].path, &t->e[i].sb);
+		free(t->e[i].path);
+	}
+	free(t->e);
+	t->e = NULL;
+	t->n = 0;
+}
+
+static int parse_topkey(const char *arg) {
+	return strcmp(arg, "size") == 0 ? KEY_SIZE : strcmp(arg, "mtime") == 0 ? KEY_MTIME : strcmp(arg, "atime") == 0 ? KEY_ATIME : -1;
+}
+
+static int parse_extended(const char *arg) {
+	return strcmp(arg, "text") == 0 ? EXT_TEXT : strcmp(arg, "json") == 0 ? EXT_JSON : EXT_NONE;
+}
+
+static void report(struct stats *st, struct extstats *e, struct outbuf *ob, const char *fpath, const struct stat *sb) {
+	if (!count_entry(st, fpath, sb)) return;
+	if (extended) ext_add(e, fpath, sb);
+	if (ob->top != NULL) top_add(ob->top, fpath, sb);
+	else if (ob->cols != NULL) col_add(ob->cols, fpath, sb);
+	else if (extended != EXT_JSON) put_line(ob, fpath, sb); // the JSON is all there is on stdout
 }
 
 #ifdef NFTW
 static int nftw_func(const char *fpath, const struct stat *sb, int type, struct FTW *ftwbuf) {
 	if (type == FTW_NS) { // failed stat() call
 		stats.n_fail++;
-		printf("%s\t?\t????\t?\t???\t???\n", fpath);
+		ob_putfailed(&out, fpath);
 		return 0; // early return, ignore stat struct contents as they are unspecified
 	}
-	report(fpath, sb);
+	report(&stats, &ext, &out, fpath, sb);
+	if (out.len >= OUTBUF_FLUSH) ob_flush(&out);
 	return 0;
 }
 
 static void walk(const char* path) {
-	int err = nftw(path, nftw_func, 8, FTW_PHYS);
+	int err = nftw(path, nftw_func, 8, follow ? 0 : FTW_PHYS);
 	if (err != 0) {
 		fprintf(stderr, "nftw() failed, returned %d!\n", err);
 		exit(2);
@@ -179,116 +720,2318 @@ static char* ss_pop(struct sizedstr *ss) {
 static uid_t uid;
 static gid_t gid;
 
-// Return whether to recurse into the path
-static bool process(const char* path) {
-	struct stat sb;
-	if (lstat(path, &sb) < 0) { // Usually fails due to file moving / getting deleted between readdir() and stat()
-		printf("%s\t?\t????\t?\t???\t???\n", path);
+static bool can_enter(const struct stat *sb) {
+	return S_ISDIR(sb->st_mode) && (
+		sb->st_uid == uid ? (sb->st_mode & S_IRUSR) > 0 && (sb->st_mode & S_IXUSR) > 0 :
+		sb->st_gid == gid ? (sb->st_mode & S_IRGRP) > 0 && (sb->st_mode & S_IXGRP) > 0 :
+		                    (sb->st_mode & S_IROTH) > 0 && (sb->st_mode & S_IXOTH) > 0
+	);
+}
+
+static struct sizedstr fullpath;
+
+// One directory of the current path. Only the deepest maxfds of them are kept open, the ones above get closed
+// with their position saved and are reopened through ".." of the level below once the walk gets back to them,
+// so neither the depth nor the length of the path is limited.
+struct level {
+	DIR *dir;       // NULL while closed, or if it couldn't be reopened
+	long pos;       // telldir() of a closed level
+	dev_t dev;      // to check that ".." is still the same directory
+	ino_t ino;
+	size_t pathlen; // of fullpath
+	uint64_t blocks; // -d: allocated so far in its subtree, including itself
+};
+
+static struct level *levels;
+static size_t nlevels, caplevels;
+static size_t lowopen; // levels below this one are closed
+static long maxfds;    // -f, 0 for the default
+
+// du mode (-d): allocated blocks are summed up per directory as the walk leaves it, counting every inode once,
+// and the heaviest directories are kept in a min-heap
+static long dutop;          // how many directories to print, 0 if not in du mode
+static uint64_t dublocks;   // of the whole walk
+static struct inodeset {
+	struct inode {
+		dev_t dev;
+		ino_t ino;
+	} *slots;               // open addressing with linear probing, ino 0 marks free slots
+	size_t cap, n;
+} inodes;
+static struct dirusage {
+	uint64_t blocks;
+	char *path;
+} *heaviest;
+static size_t nheaviest;
+
+static size_t inode_slot(const struct inodeset *s, dev_t dev, ino_t ino) {
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15u) ^ ino;
+	h *= 0xff51afd7ed558ccdu;
+	return (h ^ (h >> 32)) & (s->cap - 1);
+}
+
+// Returns false if the inode was seen already
+static bool inode_add(struct inodeset *s, dev_t dev, ino_t ino) {
+	if (ino == 0) return true; // can't be told apart from free slots, not a real inode anyway
+	if (2 * (s->n + 1) > s->cap) {
+		struct inode *old = s->slots;
+		size_t oldcap = s->cap;
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->slots = calloc(s->cap, sizeof(struct inode));
+		if (s->slots == NULL) {
+			fprintf(stderr, "Inode set allocation failed\n");
+			exit(65);
+		}
+		for (size_t i = 0; i < oldcap; i++) {
+			if (old[i].ino == 0) continue;
+			size_t j = inode_slot(s, old[i].dev, old[i].ino);
+			while (s->slots[j].ino != 0) j = (j + 1) & (s->cap - 1);
+			s->slots[j] = old[i];
+		}
+		free(old);
+	}
+	size_t j = inode_slot(s, dev, ino);
+	for (; s->slots[j].ino != 0; j = (j + 1) & (s->cap - 1)) {
+		if (s->slots[j].ino == ino && s->slots[j].dev == dev) return false;
+	}
+	s->slots[j] = (struct inode){ dev, ino };
+	s->n++;
+	return true;
+}
+
+// -L: directories seen by any walker
+static struct inodeset visited;
+static pthread_mutex_t visitedlock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns false for a directory that was already walked
+static bool first_visit(const struct stat *sb) {
+	if (!follow || !S_ISDIR(sb->st_mode)) return true;
+	pthread_mutex_lock(&visitedlock);
+	bool first = inode_add(&visited, sb->st_dev, sb->st_ino);
+	pthread_mutex_unlock(&visitedlock);
+	return first;
+}
+
+// stat() of a followed link, lstat() of the link itself if it's dangling
+static int follow_statat(int dirfd, const char *name, struct stat *sb) {
+	if (fstatat(dirfd, name, sb, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0) return 0;
+	return follow && (errno == ENOENT || errno == ELOOP) ? fstatat(dirfd, name, sb, AT_SYMLINK_NOFOLLOW) : -1;
+}
+
+static void heap_down(size_t i) {
+	while (true) {
+		size_t min = i, l = 2 * i + 1, r = l + 1;
+		if (l < nheaviest && heaviest[l].blocks < heaviest[min].blocks) min = l;
+		if (r < nheaviest && heaviest[r].blocks < heaviest[min].blocks) min = r;
+		if (min == i) return;
+		struct dirusage tmp = heaviest[i];
+		heaviest[i] = heaviest[min];
+		heaviest[min] = tmp;
+		i = min;
+	}
+}
+
+// A directory is done, blocks is its whole subtree
+static void du_dir(const char *path, uint64_t blocks) {
+	if (nheaviest == (size_t)dutop && blocks <= heaviest[0].blocks) return;
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		fprintf(stderr, "String allocation failed\n");
+		exit(65);
+	}
+	if (nheaviest == (size_t)dutop) {
+		free(heaviest[0].path);
+		heaviest[0] = (struct dirusage){ blocks, copy };
+		heap_down(0);
+		return;
+	}
+	size_t i = nheaviest++;
+	heaviest[i] = (struct dirusage){ blocks, copy };
+	for (; i > 0 && heaviest[(i - 1) / 2].blocks > heaviest[i].blocks; i = (i - 1) / 2) {
+		struct dirusage tmp = heaviest[i];
+		heaviest[i] = heaviest[(i - 1) / 2];
+		heaviest[(i - 1) / 2] = tmp;
+	}
+}
+
+static int cmp_dirusage(const void *_a, const void *_b) {
+	const struct dirusage *a = _a, *b = _b;
+	return a->blocks < b->blocks ? 1 : a->blocks > b->blocks ? -1 : strcmp(a->path, b->path);
+}
+
+// Prints the heaviest directories, in bytes, largest first
+static void du_print(void) {
+	qsort(heaviest, nheaviest, sizeof(struct dirusage), cmp_dirusage);
+	for (size_t i = 0; i < nheaviest; i++) {
+		ob_putu(&out, heaviest[i].blocks * 512);
+		ob_putc(&out, '\t');
+		ob_puts(&out, heaviest[i].path);
+		ob_putc(&out, '\n');
+		free(heaviest[i].path);
+	}
+	free(heaviest);
+	free(inodes.slots);
+}
+
+// Return whether to recurse into the entry, fullpath ends with its name
+static bool process(int dirfd, const char* name, struct stat *sb) {
+	if (follow_statat(dirfd, name, sb) < 0) { // Usually fails due to file moving / getting deleted between readdir() and stat()
+		if (dutop == 0) ob_putfailed(&out, fullpath.data);
 		stats.n_fail++;
-		//fprintf(stderr, "failed stat: %s\n", path);
+		//fprintf(stderr, "failed stat: %s\n", fullpath.data);
 		return false;
 	}
-	report(path, &sb);
-	return S_ISDIR(sb.st_mode) && (
-		sb.st_uid == uid ? (sb.st_mode & S_IRUSR) > 0 && (sb.st_mode & S_IXUSR) > 0 :
-		sb.st_gid == gid ? (sb.st_mode & S_IRGRP) > 0 && (sb.st_mode & S_IXGRP) > 0 :
-		                   (sb.st_mode & S_IROTH) > 0 && (sb.st_mode & S_IXOTH) > 0
-	);
+	if (!first_visit(sb)) return false;
+	bool enter = can_enter(sb);
+	if (dutop == 0) {
+		report(&stats, &ext, &out, fullpath.data, sb);
+		if (out.len >= OUTBUF_FLUSH) ob_flush(&out);
+	} else if (count_entry(&stats, fullpath.data, sb) && (S_ISDIR(sb->st_mode) || (sb->st_nlink < 2 && !follow) // -L: may be reached through a link too
+			|| inode_add(&inodes, sb->st_dev, sb->st_ino))) {
+		dublocks += sb->st_blocks;
+		if (!enter && nlevels > 0) levels[nlevels - 1].blocks += sb->st_blocks; // entered ones start their level with it
+	}
+	return enter;
+}
+
+static void push_level(DIR *dir, const struct stat *sb) {
+	if (nlevels == caplevels) {
+		caplevels = caplevels ? caplevels * 2 : 64;
+		levels = realloc(levels, caplevels * sizeof(struct level));
+		if (levels == NULL) {
+			fprintf(stderr, "Level allocation failed\n");
+			exit(65);
+		}
+	}
+	levels[nlevels++] = (struct level){ .dir = dir, .dev = sb->st_dev, .ino = sb->st_ino, .pathlen = fullpath.len, .blocks = sb->st_blocks };
+	if (nlevels - lowopen > (size_t)maxfds) {
+		struct level *l = &levels[lowopen++];
+		l->pos = telldir(l->dir);
+		if (l->pos == -1 || closedir(l->dir) != 0) {
+			perror("Failed to close directory");
+			exit(1);
+		}
+		l->dir = NULL;
+	}
+}
+
+// Opens dirfd/name if it's still the directory of level l, returns -1 otherwise
+static int open_level(int dirfd, const char *name, const struct level *l) {
+	int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat sb;
+	if (fd != -1 && (fstat(fd, &sb) != 0 || sb.st_dev != l->dev || sb.st_ino != l->ino)) {
+		close(fd);
+		errno = ESTALE;
+		fd = -1;
+	}
+	return fd;
+}
+
+// Finishes the deepest level and makes sure the one above it is open again, unless that fails
+static void pop_level(void) {
+	struct level *l = &levels[--nlevels];
+	struct level *up = nlevels > 0 ? l - 1 : NULL;
+	if (dutop > 0) {
+		du_dir(fullpath.data, l->blocks);
+		if (up != NULL) up->blocks += l->blocks;
+	}
+	int fd = -1;
+	if (up != NULL && up->dir == NULL && l->dir != NULL) fd = open_level(dirfd(l->dir), "..", up);
+	if (l->dir != NULL && closedir(l->dir) != 0) {
+		perror("Failed to close directory");
+		exit(1);
+	}
+	if (up == NULL) return;
+	fullpath.len = up->pathlen;
+	fullpath.data[fullpath.len] = '\0';
+	if (nlevels > lowopen) return; // still open
+	lowopen--;
+	if (fd == -1) fd = open_level(AT_FDCWD, fullpath.data, up); // renamed meanwhile, try the path instead
+	if (fd != -1 && (up->dir = fdopendir(fd)) == NULL) close(fd);
+	if (up->dir == NULL) {
+		perror("Could not reopen directory");
+		fprintf(stderr, "%s\n", fullpath.data);
+		stats.n_fail++;
+		return;
+	}
+	seekdir(up->dir, up->pos);
 }
 
-static DIR* dirs[256];
-static struct sizedstr fullpath;
 static void walk(const char* path) {
 	uid = geteuid();
 	gid = getegid();
+	if (dutop > 0 && (heaviest = malloc(dutop * sizeof(struct dirusage))) == NULL) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(65);
+	}
+	if (maxfds == 0) {
+		struct rlimit rl;
+		maxfds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (long)rl.rlim_cur / 2 : 512;
+	}
 
-	unsigned depth = 0;
 	ss_assign(&fullpath, path);
 
-	if (!process(fullpath.data)) return;
-	dirs[0] = opendir(fullpath.data);
-	if (dirs[0] == NULL) {
+	struct stat sb;
+	if (!process(AT_FDCWD, fullpath.data, &sb)) return;
+	DIR *root = opendir(fullpath.data);
+	if (root == NULL) {
 		perror("Could not open search directory");
 		exit(1);
 	}
+	push_level(root, &sb);
 
-	while (true) {
+	while (nlevels > 0) {
+		DIR *dir = levels[nlevels - 1].dir;
 		errno = 0;
-		struct dirent *ent = readdir(dirs[depth]);
-		if (ent == NULL && errno == 0) {
+		struct dirent *ent = dir != NULL ? readdir(dir) : NULL;
+		if (ent == NULL) {
+			if (errno != 0) {
+				perror("Failed to read directory"); // Happens for /net directory for zombie processes in /proc
+				fprintf(stderr, "%s\n", fullpath.data);
+				stats.n_fail++;
+			}
 			//printf("End of dir: %s\n", fullpath.data);
-			if (closedir(dirs[depth]) != 0) {
-				perror("Failed to close directory");
+			pop_level();
+			continue;
+		}
+		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+			continue; // Ignore . and .. entries
+		}
+		size_t len = fullpath.len;
+		ss_push(&fullpath, ent->d_name);
+		if (process(dirfd(dir), ent->d_name, &sb)) {
+			//printf("Recursing into dir %s\n", fullpath.data);
+			int fd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+			DIR *sub = fd != -1 ? fdopendir(fd) : NULL;
+			if (sub == NULL) {
+				perror("Could not open directory");
 				exit(1);
 			}
-			if (depth == 0) break;
-			depth--;
-			char *popped = ss_pop(&fullpath);
-			assert(popped != NULL);
-		} else if (ent == NULL) {
-			perror("Failed to read directory"); // Happens for /net directory for zombie processes in /proc
-			fprintf(stderr, "%s\n", fullpath.data);
-			//exit(1);
-			stats.n_fail++;
-			if (depth == 0) break;
-			depth--;
-			char *popped = ss_pop(&fullpath);
-			assert(popped != NULL);
+			push_level(sub, &sb);
 		} else {
-			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
-				continue; // Ignore . and .. entries
-			}
-			//printf("Dir entry: %s - entry %s\n", fullpath.data, ent->d_name);
-			ss_push(&fullpath, ent->d_name);
-			//printf("%s\n", fullpath.data);
-			if (process(fullpath.data)) {
-				if (depth + 1 >= sizeof(dirs) / sizeof(dirs[0])) {
-					fprintf(stderr, "Too many levels of subdirectories! Not recursing!\n");
-					char *popped = ss_pop(&fullpath);
-					assert(popped != NULL);
-					stats.n_fail++;
-					continue;
-				}
-				//printf("Recursing into dir %s\n", fullpath.data);
-				dirs[++depth] = opendir(fullpath.data);
-				if (dirs[depth] == NULL) {
-					perror("Could not open directory");
-					exit(1);
-				}
-			} else {
-				char *popped = ss_pop(&fullpath);
-				assert(popped != NULL);
-				//printf("Processed entry, now in: %s\n", fullpath.data);
-			}
+			fullpath.len = len;
+			fullpath.data[len] = '\0';
 		}
 	}
 
+	free(levels);
+	levels = NULL;
+	nlevels = caplevels = lowopen = 0;
 	ss_free(&fullpath);
+	if (dutop > 0) du_print();
 }
-#endif
 
-int main(int argc, char** argv) {
-	if (argc != 2) {
-		printf("Usage: %s <dir path>\n", argc > 0 ? argv[0] : PROGNAME);
-		exit(2);
+// Parallel walker (-j, -s). Every thread keeps a deque of directories waiting to be read: it pushes the
+// subdirectories it finds and pops them back from the same end, so it walks depth-first, while idle
+// threads steal from the other end, taking directories close to the root with the most work under them.
+// Entries are stat()ed relative to the already open directory, without resolving the whole path again.
+struct dirwork {
+	char *path;
+	int fd;          // -1: not opened yet, reopened by path when its turn comes
+	unsigned depth;
+	unsigned dev;    // index into devices
+	dev_t devid;
+	bool gated;      // the device has fewer slots than there are walkers
+};
+
+// Output line of sorted mode, at offset off in the output buffer of its thread
+struct record {
+	const char *line;
+	size_t off;
+	size_t len;
+	size_t pathlen;
+};
+
+struct walker {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	struct dirwork *items; // [head, tail) is queued, the owner works at the tail and thieves at the head
+	size_t head, tail, cap;
+	struct stats stats;
+	struct extstats ext;    // -e only
+	struct sizedstr path;
+	struct outbuf out;
+	char *dirbuf;
+	struct ring *ring;      // -u only
+	bool noring;            // setting it up failed
+	struct record *records; // -s only
+	size_t nrecords, caprecords;
+};
+
+static struct walker *walkers;
+static long nwalkers;
+static bool sorted;
+static unsigned ringdepth; // -u
+static const char *colfile; // -b
+static bool ringfailed;
+static long fdbudget; // directories queued with an open fd, beyond this they are reopened by path
+static long openfds;
+static size_t pending; // directories pushed but not finished yet, the walk ends when this drops to 0
+static size_t queued;  // directories sitting in deques
+static unsigned nidle;
+static pthread_mutex_t idlelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idlecond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t outlock = PTHREAD_MUTEX_INITIALIZER; // big writes to a pipe aren't atomic
+
+static void flush_walker(struct walker *w) {
+	pthread_mutex_lock(&outlock);
+	ob_flush(&w->out);
+	pthread_mutex_unlock(&outlock);
+}
+
+static void push_work(struct walker *w, struct dirwork item) {
+	__atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&w->lock);
+	if (w->tail == w->cap) {
+		if (w->head > 0) {
+			memmove(w->items, w->items + w->head, (w->tail - w->head) * sizeof(struct dirwork));
+			w->tail -= w->head;
+			w->head = 0;
+		} else {
+			w->cap = w->cap ? w->cap * 2 : 64;
+			w->items = realloc(w->items, w->cap * sizeof(struct dirwork));
+			if (w->items == NULL) {
+				fprintf(stderr, "Work queue allocation failed\n");
+				exit(65);
+			}
+		}
 	}
-	char* path = realpath(argv[1], NULL);
-	if (path == NULL) {
-		perror("Could not obtain realpath");
-		exit(1);
+	w->items[w->tail++] = item;
+	pthread_mutex_unlock(&w->lock);
+	__atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&nidle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&idlelock);
+		pthread_cond_signal(&idlecond);
+		pthread_mutex_unlock(&idlelock);
+	}
+}
+
+static bool take_work(struct walker *w, bool steal, struct dirwork *item) {
+	bool found = false;
+	pthread_mutex_lock(&w->lock);
+	if (w->head < w->tail) {
+		*item = steal ? w->items[w->head++] : w->items[--w->tail];
+		if (w->head == w->tail) w->head = w->tail = 0;
+		found = true;
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (found) __atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+	return found;
+}
+
+// Own deque first, then the others. Sleeps while there is nothing to take, false once the walk is over.
+static bool get_work(struct walker *w, struct dirwork *item) {
+	long self = w - walkers;
+	while (true) {
+		if (take_work(w, false, item)) return true;
+		for (long i = 1; i < nwalkers; i++) {
+			if (take_work(&walkers[(self + i) % nwalkers], true, item)) return true;
+		}
+		pthread_mutex_lock(&idlelock);
+		__atomic_add_fetch(&nidle, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&pending, __ATOMIC_SEQ_CST) > 0)
+			pthread_cond_wait(&idlecond, &idlelock);
+		__atomic_sub_fetch(&nidle, 1, __ATOMIC_SEQ_CST);
+		bool done = __atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0;
+		pthread_mutex_unlock(&idlelock);
+		if (done) return false;
+	}
+}
+
+// Devices. Every directory is scanned with a slot of its device (by st_dev), each device has as many slots as
+// the limit of its class: a disk that has to seek gets one, so it isn't thrashed, while solid state and network
+// ones let every walker in. Directories of a device with no free slot are parked and queued again as its scans
+// finish, the walkers meanwhile take work from other devices, so all of them progress at once.
+enum { DEV_SSD, DEV_HDD, DEV_NET, DEV_CLASSES };
+static const char *const class_names[DEV_CLASSES] = { "ssd", "hdd", "net" };
+static long class_limits[DEV_CLASSES]; // -c, 0 for the default
+static bool devgating; // some class has fewer slots than there are walkers, so crossing a mount point matters
+
+struct device {
+	dev_t dev;
+	int class;
+	long limit, active;
+	struct dirwork *parked;
+	size_t nparked, capparked;
+};
+
+static struct device *devices;
+static size_t ndevices;
+static pthread_mutex_t devlock = PTHREAD_MUTEX_INITIALIZER;
+
+// By whether the queue of the block device is rotational
+static int block_class(dev_t dev) {
+	char file[64];
+	for (int up = 0; up < 2; up++) { // partitions have their queue in the parent device
+		snprintf(file, sizeof(file), "/sys/dev/block/%u:%u/%squeue/rotational", major(dev), minor(dev), up ? "../" : "");
+		FILE *f = fopen(file, "r");
+		if (f == NULL) continue;
+		int rotational = fgetc(f);
+		fclose(f);
+		return rotational == '1' ? DEV_HDD : DEV_SSD;
+	}
+	return DEV_SSD;
+}
+
+// Mount points from /proc/self/mountinfo, read once when the parallel walk starts and sorted by path. A directory
+// entered without stat() is looked up here to notice that the walk crosses into another device.
+struct mountpoint {
+	char *path;
+	dev_t dev;
+	dev_t source; // block device it's mounted from, 0 if none (overlay, tmpfs)
+	size_t seq;   // of the line, later ones are mounted over earlier ones at the same path
+};
+
+static struct mountpoint *mounts;
+static size_t nmounts;
+
+static int cmp_mountpaths(const void *_a, const void *_b) {
+	return strcmp(((const struct mountpoint*)_a)->path, ((const struct mountpoint*)_b)->path);
+}
+
+static int cmp_mountpoints(const void *_a, const void *_b) {
+	const struct mountpoint *a = _a, *b = _b;
+	int c = strcmp(a->path, b->path);
+	return c != 0 ? c : (a->seq > b->seq) - (a->seq < b->seq);
+}
+
+// Undoes the octal escapes of spaces, tabs, newlines and backslashes in place
+static void unescape_mountinfo(char *s) {
+	char *out = s;
+	for (; *s != '\0'; s++) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*out++ = (s[1] - '0') << 6 | (s[2] - '0') << 3 | (s[3] - '0');
+			s += 3;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+}
+
+static void load_mounts(void) {
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	if (f == NULL) return;
+	char *line = NULL;
+	size_t cap = 0, capmounts = 0;
+	while (getline(&line, &cap, f) != -1) {
+		unsigned maj, min;
+		int at = 0;
+		char *sep = strstr(line, " - ");
+		char source[PATH_MAX];
+		struct stat sb;
+		// ID parent major:minor root mountpoint options... - fstype source superoptions
+		if (sscanf(line, "%*u %*u %u:%u %*s %n", &maj, &min, &at) != 2 || at == 0 || sep == NULL) continue;
+		char *path = line + at;
+		path[strcspn(path, " ")] = '\0';
+		unescape_mountinfo(path);
+		if (nmounts == capmounts) {
+			capmounts = capmounts ? capmounts * 2 : 64;
+			struct mountpoint *grown = realloc(mounts, capmounts * sizeof(struct mountpoint));
+			if (grown == NULL) {
+				fprintf(stderr, "Mount table allocation failed\n");
+				exit(65);
+			}
+			mounts = grown;
+		}
+		struct mountpoint *m = &mounts[nmounts];
+		*m = (struct mountpoint){ .path = strdup(path), .dev = makedev(maj, min), .seq = nmounts };
+		if (m->path == NULL) {
+			fprintf(stderr, "String allocation failed\n");
+			exit(65);
+		}
+		if (sscanf(sep, " - %*s %4095s", source) == 1 && source[0] == '/' && stat(source, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+			m->source = sb.st_rdev;
+		}
+		nmounts++;
+	}
+	free(line);
+	fclose(f);
+	qsort(mounts, nmounts, sizeof(struct mountpoint), cmp_mountpoints);
+	// Of mounts over one another, only the last one is visible
+	size_t n = 0;
+	for (size_t i = 0; i < nmounts; i++) {
+		if (n > 0 && strcmp(mounts[n - 1].path, mounts[i].path) == 0) free(mounts[--n].path);
+		mounts[n++] = mounts[i];
+	}
+	nmounts = n;
+}
+
+static void free_mounts(void) {
+	for (size_t i = 0; i < nmounts; i++) free(mounts[i].path);
+	free(mounts);
+	mounts = NULL;
+	nmounts = 0;
+}
+
+static const struct mountpoint *find_mount(const char *path) {
+	if (path[0] == '/' && path[1] == '/') path++; // below the root "/"
+	struct mountpoint key = { .path = (char*)path };
+	return bsearch(&key, mounts, nmounts, sizeof(struct mountpoint), cmp_mountpaths);
+}
+
+// Block device a filesystem with an anonymous st_dev (btrfs and the like) is mounted from, 0 if it isn't
+// mounted from one (overlay, tmpfs)
+static dev_t mount_source(dev_t dev) {
+	for (size_t i = 0; i < nmounts; i++) {
+		if (mounts[i].dev == dev && mounts[i].source != 0) return mounts[i].source;
+	}
+	return 0;
+}
+
+// Block devices by whether their queue is rotational, anything else by the filesystem at path
+static int device_class(dev_t dev, const char *path) {
+	if (major(dev) != 0) return block_class(dev);
+	struct statfs sf;
+	if (statfs(path, &sf) != 0) return DEV_SSD;
+	switch ((unsigned long)sf.f_type) {
+		case 0x6969:     // NFS
+		case 0x517b:     // SMB
+		case 0xff534d42: // CIFS
+		case 0xfe534d42: // SMB2
+		case 0x65735546: // FUSE, sshfs and the like
+		case 0x00c36400: // Ceph
+		case 0x01021997: // 9P
+			return DEV_NET;
+		default: {
+			dev_t source = mount_source(dev);
+			return source != 0 ? block_class(source) : DEV_SSD;
+		}
+	}
+}
+
+static long class_limit(int class) {
+	return class_limits[class] > 0 ? class_limits[class] : class == DEV_HDD ? 1 : nwalkers;
+}
+
+// Sets the device of a directory at path, registering it when it's seen for the first time
+static void set_device(struct dirwork *item, dev_t dev, const char *path) {
+	pthread_mutex_lock(&devlock);
+	size_t i = 0;
+	while (i < ndevices && devices[i].dev != dev) i++;
+	if (i == ndevices) {
+		struct device *grown = realloc(devices, (ndevices + 1) * sizeof(struct device));
+		if (grown == NULL) {
+			fprintf(stderr, "Device allocation failed\n");
+			exit(65);
+		}
+		devices = grown;
+		int class = device_class(dev, path);
+		devices[ndevices++] = (struct device){ .dev = dev, .class = class,
+			.limit = class_limit(class) };
+	}
+	item->dev = i;
+	item->devid = dev;
+	item->gated = devices[i].limit < nwalkers;
+	pthread_mutex_unlock(&devlock);
+}
+
+// Takes a slot of the item's device, or parks the item if there's none
+static bool dev_acquire(struct dirwork *item) {
+	pthread_mutex_lock(&devlock);
+	struct device *d = &devices[item->dev];
+	bool ok = d->active < d->limit;
+	if (ok) {
+		d->active++;
+	} else {
+		if (d->nparked == d->capparked) {
+			d->capparked = d->capparked ? d->capparked * 2 : 64;
+			d->parked = realloc(d->parked, d->capparked * sizeof(struct dirwork));
+			if (d->parked == NULL) {
+				fprintf(stderr, "Work queue allocation failed\n");
+				exit(65);
+			}
+		}
+		d->parked[d->nparked++] = *item;
+		// No longer pending, requeued when a slot frees up. The scans holding the slots are still pending.
+		__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+	}
+	pthread_mutex_unlock(&devlock);
+	return ok;
+}
+
+static void dev_release(struct walker *w, unsigned dev) {
+	pthread_mutex_lock(&devlock);
+	struct device *d = &devices[dev];
+	d->active--;
+	bool requeue = d->nparked > 0;
+	struct dirwork item;
+	if (requeue) item = d->parked[--d->nparked];
+	pthread_mutex_unlock(&devlock);
+	if (requeue) push_work(w, item);
+}
+
+static void free_devices(void) {
+	for (size_t i = 0; i < ndevices; i++) free(devices[i].parked);
+	free(devices);
+	devices = NULL;
+	ndevices = 0;
+}
+
+// "class=N,...", slots per device of the class
+static bool parse_limits(char *arg) {
+	for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		char *eq = strchr(tok, '='), *end;
+		if (eq == NULL) return false;
+		*eq = '\0';
+		int c = 0;
+		while (c < DEV_CLASSES && strcmp(tok, class_names[c]) != 0) c++;
+		if (c == DEV_CLASSES) return false;
+		class_limits[c] = strtol(eq + 1, &end, 10);
+		if (eq[1] == '\0' || *end != '\0' || class_limits[c] <= 0) return false;
+	}
+	return true;
+}
+
+static void add_record(struct walker *w, size_t pathlen) {
+	if (!sorted || extended == EXT_JSON) return;
+	if (w->nrecords == w->caprecords) {
+		w->caprecords = w->caprecords ? w->caprecords * 2 : 1024;
+		w->records = realloc(w->records, w->caprecords * sizeof(struct record));
+		if (w->records == NULL) {
+			fprintf(stderr, "Record allocation failed\n");
+			exit(65);
+		}
+	}
+	w->records[w->nrecords++] = (struct record) { .off = w->out.len, .pathlen = pathlen };
+}
+
+// Filters (-t, -n, -z, -m, -D) of the parallel walker, checked cheapest first: the depth, then the type from
+// d_type and the name, which cost no syscall, then the type, size and mtime once the entry is stat()ed.
+// An entry d_type already rules out isn't stat()ed at all, unless it's a directory to walk, and those are
+// opened without stat() too. Only matching entries are printed and counted.
+static struct {
+	bool on;
+	unsigned types;            // bit 1 << (S_IFMT bits >> 12), the same as 1 << d_type
+	const char *glob;
+	int64_t minsize, maxsize;
+	int64_t minmtime, maxmtime;
+	unsigned mindepth, maxdepth;
+} filter = {
+	.types = ~0u,
+	.minsize = INT64_MIN, .maxsize = INT64_MAX,
+	.minmtime = INT64_MIN, .maxmtime = INT64_MAX,
+	.maxdepth = UINT_MAX,
+};
+
+enum { F_SKIP, F_WALK, F_SHOW };
+
+// Decides what can be without stat(): F_SKIP if the entry can be ignored, F_WALK if it isn't shown but may be
+// a directory to walk, F_SHOW if it's shown when filter_stat() agrees.
+static int filter_entry(const char *name, unsigned char type, unsigned depth) {
+	if (!filter.on) return F_SHOW;
+	if (depth >= filter.mindepth
+			&& (type == DT_UNKNOWN || (filter.types & 1u << type))
+			&& (filter.glob == NULL || fnmatch(filter.glob, name, 0) == 0))
+		return F_SHOW;
+	return (type == DT_DIR || type == DT_UNKNOWN) && depth < filter.maxdepth ? F_WALK : F_SKIP;
+}
+
+static bool filter_stat(const struct stat *sb) {
+	return !filter.on || ((filter.types & 1u << ((sb->st_mode & S_IFMT) >> 12))
+		&& sb->st_size >= filter.minsize && sb->st_size <= filter.maxsize
+		&& sb->st_mtime >= filter.minmtime && sb->st_mtime <= filter.maxmtime);
+}
+
+// "[+-]N[kMGT]": bigger than, smaller than or exactly N bytes
+static bool parse_size(const char *arg) {
+	char *end;
+	char op = *arg == '+' || *arg == '-' ? *arg++ : '=';
+	if (*arg < '0' || *arg > '9') return false;
+	int64_t n = strtoll(arg, &end, 10);
+	const char *units = "kMGT";
+	const char *unit = *end != '\0' ? strchr(units, *end) : NULL;
+	if (unit != NULL) {
+		for (int i = 0; i <= unit - units; i++) {
+			if (n > INT64_MAX / 1024) return false;
+			n *= 1024;
+		}
+		end++;
+	}
+	if (*end != '\0') return false;
+	if (op != '-') filter.minsize = op == '+' ? n + 1 : n;
+	if (op != '+') filter.maxsize = op == '-' ? n - 1 : n;
+	return true;
+}
+
+// "[+-]N": modified more than, less than or exactly N days ago, counted in whole days like find -mtime
+static bool parse_mtime(const char *arg) {
+	char *end;
+	char op = *arg == '+' || *arg == '-' ? *arg++ : '=';
+	if (*arg < '0' || *arg > '9') return false;
+	long days = strtol(arg, &end, 10);
+	if (*end != '\0' || days > 1000000) return false;
+	int64_t now = time(NULL);
+	if (op != '-') filter.maxmtime = now - (op == '+' ? days + 1 : days) * 86400;
+	if (op != '+') filter.minmtime = now - (op == '-' ? days : days + 1) * 86400 + 1;
+	return true;
+}
+
+// "N", "N:", ":M" or "N:M": depth of the entries to show, the root is 0
+static bool parse_depth(const char *arg) {
+	char *end;
+	if (*arg != ':') {
+		filter.mindepth = strtoul(arg, &end, 10);
+		if (end == arg || (*end != ':' && *end != '\0')) return false;
+		if (*end == '\0') filter.maxdepth = filter.mindepth;
+		arg = end;
+	}
+	if (*arg == ':' && *++arg != '\0') {
+		filter.maxdepth = strtoul(arg, &end, 10);
+		if (*end != '\0') return false;
+	}
+	return filter.mindepth <= filter.maxdepth;
+}
+
+// Letters as in find -type
+static bool parse_types(const char *arg) {
+	filter.types = 0;
+	for (; *arg != '\0'; arg++) {
+		switch (*arg) {
+			case 'f': filter.types |= 1u << DT_REG; break;
+			case 'd': filter.types |= 1u << DT_DIR; break;
+			case 'l': filter.types |= 1u << DT_LNK; break;
+			case 's': filter.types |= 1u << DT_SOCK; break;
+			case 'p': filter.types |= 1u << DT_FIFO; break;
+			case 'c': filter.types |= 1u << DT_CHR; break;
+			case 'b': filter.types |= 1u << DT_BLK; break;
+			default: return false;
+		}
+	}
+	return filter.types != 0;
+}
+
+static bool have_statx = true;
+
+static unsigned statx_mask(unsigned char type) {
+	unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_INO;
+	if (type == DT_DIR || type == DT_UNKNOWN) mask |= STATX_UID | STATX_GID;
+	return mask;
+}
+
+static void statx_to_stat(const struct statx *stx, struct stat *sb) {
+	sb->st_mode = stx->stx_mode;
+	sb->st_nlink = stx->stx_nlink;
+	sb->st_size = stx->stx_size;
+	sb->st_atime = stx->stx_atime.tv_sec;
+	sb->st_mtime = stx->stx_mtime.tv_sec;
+	sb->st_uid = stx->stx_uid;
+	sb->st_gid = stx->stx_gid;
+	sb->st_ino = stx->stx_ino;
+	sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+}
+
+// lstat() relative to dirfd, asking statx() only for the fields report() and can_enter() look at. Ownership
+// only matters for directories, when d_type already tells the entry isn't one it isn't fetched.
+// With -L it's stat(), unless the link is dangling.
+static int stat_at(int dirfd, const char *name, unsigned char type, struct stat *sb) {
+	if (have_statx) {
+		struct statx stx;
+		if (statx(dirfd, name, (follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_NO_AUTOMOUNT, statx_mask(type), &stx) == 0
+				|| (follow && (errno == ENOENT || errno == ELOOP)
+					&& statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, statx_mask(type), &stx) == 0)) {
+			statx_to_stat(&stx, sb);
+			return 0;
+		}
+		if (errno != ENOSYS) return -1;
+		have_statx = false; // Kernel older than 4.11
+	}
+	return follow_statat(dirfd, name, sb);
+}
+
+// Duplicate detection (-H). Regular files are grouped by size as the walk finds them. As soon as a size has
+// a second file, the files of that size are handed to a pool of hashing threads, which hash their first
+// HEAD_SIZE bytes; files whose heads match some other file's get their whole contents hashed in turn. It all
+// runs while the walk continues, groups with equal full hashes are printed at the end. Hard links to an
+// already seen inode and empty files are left out. Both checks are hash lookups, a file costs the same however
+// big its size group gets.
+struct digest {
+	uint64_t a, b;
+};
+
+struct dupfile {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct digest head, full;
+	bool headdone, fullqueued, fulldone, failed;
+	struct sizegroup *group;
+	struct dupfile *next; // in the group
+};
+
+// Files of a size group by head digest, open addressing, first is NULL in free slots
+struct headslot {
+	struct digest head;
+	struct dupfile *first; // whose head hash finished first
+};
+
+struct sizegroup {
+	int64_t size;
+	unsigned n;
+	struct dupfile *files;
+	struct headslot *heads; // once a head is done, only for sizes above HEAD_SIZE
+	size_t capheads, nheads;
+};
+
+struct dupjob {
+	struct dupfile *file;
+	bool full;
+};
+
+static long nhashers;                  // -H
+static uint64_t dupbytes;              // taken by copies, beyond the first of each group
+static pthread_t *hashers;
+static pthread_mutex_t duplock = PTHREAD_MUTEX_INITIALIZER; // everything below
+static pthread_cond_t dupcond = PTHREAD_COND_INITIALIZER;
+static struct sizegroup **groups;      // open addressing by size, linear probing
+static size_t capgroups, ngroups;
+static struct inodeset dupinodes;      // of every group, an inode has a single size anyway
+static struct dupjob *jobs;            // ring buffer
+static size_t jobhead, njobs, capjobs;
+static long busyhashers;
+static bool walkdone;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// 128 bits out of two independent lanes over 8-byte words, fast but not cryptographic
+static void hash_update(struct digest *d, const unsigned char *p, size_t n) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		d->a = rotl(d->a ^ (w * 0x87c37b91114253d5u), 31) * 0x9e3779b97f4a7c15u;
+		d->b = rotl(d->b + (w * 0x4cf5ad432745937fu), 27) * 0xc2b2ae3d27d4eb4fu + 0x52dce729;
+	}
+	if (i < n) {
+		uint64_t w = 0;
+		memcpy(&w, p + i, n - i);
+		d->a = rotl(d->a ^ (w * 0x87c37b91114253d5u), 31) * 0x9e3779b97f4a7c15u;
+		d->b = rotl(d->b + (w * 0x4cf5ad432745937fu), 27) * 0xc2b2ae3d27d4eb4fu + 0x52dce729;
+	}
+}
+
+static void queue_job(struct dupfile *f, bool full) {
+	if (njobs == capjobs) {
+		size_t cap = capjobs ? capjobs * 2 : 256;
+		struct dupjob *grown = malloc(cap * sizeof(struct dupjob));
+		if (grown == NULL) {
+			fprintf(stderr, "Job allocation failed\n");
+			exit(65);
+		}
+		for (size_t i = 0; i < njobs; i++) grown[i] = jobs[(jobhead + i) % capjobs];
+		free(jobs);
+		jobs = grown;
+		jobhead = 0;
+		capjobs = cap;
+	}
+	jobs[(jobhead + njobs++) % capjobs] = (struct dupjob){ f, full };
+	if (full) f->fullqueued = true;
+	pthread_cond_signal(&dupcond);
+}
+
+static struct sizegroup *find_group(int64_t size) {
+	if (2 * (ngroups + 1) > capgroups) {
+		struct sizegroup **old = groups;
+		size_t oldcap = capgroups;
+		capgroups = capgroups ? capgroups * 2 : 1024;
+		groups = calloc(capgroups, sizeof(struct sizegroup*));
+		if (groups == NULL) {
+			fprintf(stderr, "Group allocation failed\n");
+			exit(65);
+		}
+		for (size_t i = 0; i < oldcap; i++) {
+			if (old[i] == NULL) continue;
+			size_t j = (uint64_t)old[i]->size * 0x9e3779b97f4a7c15u >> 20 & (capgroups - 1);
+			while (groups[j] != NULL) j = (j + 1) & (capgroups - 1);
+			groups[j] = old[i];
+		}
+		free(old);
+	}
+	size_t j = (uint64_t)size * 0x9e3779b97f4a7c15u >> 20 & (capgroups - 1);
+	for (; groups[j] != NULL; j = (j + 1) & (capgroups - 1)) {
+		if (groups[j]->size == size) return groups[j];
+	}
+	if ((groups[j] = calloc(1, sizeof(struct sizegroup))) == NULL) {
+		fprintf(stderr, "Group allocation failed\n");
+		exit(65);
+	}
+	groups[j]->size = size;
+	ngroups++;
+	return groups[j];
+}
+
+// Called by the walkers for every regular file that gets printed
+static void dup_add(const char *path, const struct stat *sb) {
+	if (sb->st_size == 0) return;
+	pthread_mutex_lock(&duplock);
+	if (!inode_add(&dupinodes, sb->st_dev, sb->st_ino)) { // a hard link to a file already in its group
+		pthread_mutex_unlock(&duplock);
+		return;
+	}
+	struct sizegroup *g = find_group(sb->st_size);
+	struct dupfile *f = calloc(1, sizeof(struct dupfile));
+	if (f == NULL || (f->path = strdup(path)) == NULL) {
+		fprintf(stderr, "String allocation failed\n");
+		exit(65);
+	}
+	f->dev = sb->st_dev;
+	f->ino = sb->st_ino;
+	f->group = g;
+	f->next = g->files;
+	g->files = f;
+	if (++g->n == 2) queue_job(f->next, false);
+	if (g->n >= 2) queue_job(f, false);
+	pthread_mutex_unlock(&duplock);
+}
+
+// Hashes the first HEAD_SIZE bytes of the file, or all of it. Fails if it can't be read that far, then it
+// changed since it was stat()ed and is left out.
+static bool hash_file(struct dupfile *f, bool full, unsigned char *buf) {
+	int fd = open(f->path, O_RDONLY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+	if (fd == -1) {
+		perror("Could not open file for hashing");
+		fprintf(stderr, "%s\n", f->path);
+		return false;
+	}
+	if (full) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	struct digest d = { 0x243f6a8885a308d3u, 0x13198a2e03707344u };
+	int64_t want = full || f->group->size < HEAD_SIZE ? f->group->size : HEAD_SIZE, done = 0;
+	ssize_t n = 0;
+	while (done < want && (n = read(fd, buf, want - done < HASHBUF_SIZE ? want - done : HASHBUF_SIZE)) > 0) {
+		hash_update(&d, buf, n);
+		done += n;
+	}
+	close(fd);
+	if (done < want) {
+		if (n == -1) perror("Could not read file for hashing");
+		else fprintf(stderr, "File shrunk while hashing\n");
+		fprintf(stderr, "%s\n", f->path);
+		return false;
+	}
+	if (full) f->full = d;
+	else f->head = d;
+	return true;
+}
+
+static size_t head_slot(const struct headslot *slots, size_t cap, const struct digest *head) {
+	size_t j = head->a & (cap - 1);
+	while (slots[j].first != NULL && memcmp(&slots[j].head, head, sizeof(*head)) != 0) j = (j + 1) & (cap - 1);
+	return j;
+}
+
+// Returns the file that had the same head first, or NULL if f is the first one
+static struct dupfile *head_add(struct sizegroup *g, struct dupfile *f) {
+	if (2 * (g->nheads + 1) > g->capheads) {
+		size_t cap = g->capheads ? g->capheads * 2 : 8;
+		struct headslot *slots = calloc(cap, sizeof(struct headslot));
+		if (slots == NULL) {
+			fprintf(stderr, "Head table allocation failed\n");
+			exit(65);
+		}
+		for (size_t i = 0; i < g->capheads; i++) {
+			if (g->heads[i].first != NULL) slots[head_slot(slots, cap, &g->heads[i].head)] = g->heads[i];
+		}
+		free(g->heads);
+		g->heads = slots;
+		g->capheads = cap;
+	}
+	struct headslot *slot = &g->heads[head_slot(g->heads, g->capheads, &f->head)];
+	if (slot->first != NULL) return slot->first;
+	*slot = (struct headslot){ f->head, f };
+	g->nheads++;
+	return NULL;
+}
+
+static void* hasher_main(void *arg) {
+	(void)arg;
+	unsigned char *buf = malloc(HASHBUF_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "Buffer allocation failed\n");
+		exit(65);
+	}
+	pthread_mutex_lock(&duplock);
+	while (true) {
+		while (njobs == 0 && !(walkdone && busyhashers == 0)) pthread_cond_wait(&dupcond, &duplock);
+		if (njobs == 0) break;
+		struct dupjob job = jobs[jobhead];
+		jobhead = (jobhead + 1) % capjobs;
+		njobs--;
+		busyhashers++;
+		pthread_mutex_unlock(&duplock);
+		struct dupfile *f = job.file;
+		bool ok = hash_file(f, job.full, buf);
+		pthread_mutex_lock(&duplock);
+		busyhashers--;
+		if (!ok) {
+			f->failed = true;
+		} else if (job.full) {
+			f->fulldone = true;
+		} else {
+			f->headdone = true;
+			if (f->group->size <= HEAD_SIZE) { // the head is all of it
+				f->full = f->head;
+				f->fulldone = true;
+			} else {
+				// Files with the same head need a closer look
+				struct dupfile *o = head_add(f->group, f);
+				if (o != NULL) {
+					if (!o->fullqueued) queue_job(o, true);
+					queue_job(f, true);
+				}
+			}
+		}
+		if (walkdone && njobs == 0 && busyhashers == 0) pthread_cond_broadcast(&dupcond);
+	}
+	pthread_mutex_unlock(&duplock);
+	free(buf);
+	return NULL;
+}
+
+static void dup_start(void) {
+	hashers = malloc(nhashers * sizeof(pthread_t));
+	if (hashers == NULL) {
+		fprintf(stderr, "Thread allocation failed\n");
+		exit(65);
+	}
+	for (long t = 0; t < nhashers; t++) {
+		if (pthread_create(&hashers[t], NULL, hasher_main, NULL) != 0) {
+			perror("Failed to create thread");
+			exit(1);
+		}
+	}
+}
+
+// Whether the two files of the given size have the same contents, the hash alone can be fooled on purpose
+static bool same_content(const struct dupfile *a, const struct dupfile *b, int64_t size, unsigned char *buf) {
+	int fda = open(a->path, O_RDONLY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+	int fdb = open(b->path, O_RDONLY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+	bool same = fda != -1 && fdb != -1;
+	for (int64_t done = 0; same && done < size; ) {
+		size_t want = size - done < HASHBUF_SIZE / 2 ? size - done : HASHBUF_SIZE / 2;
+		same = read(fda, buf, want) == (ssize_t)want && read(fdb, buf + want, want) == (ssize_t)want
+			&& memcmp(buf, buf + want, want) == 0;
+		done += want;
+	}
+	if (fda != -1) close(fda);
+	if (fdb != -1) close(fdb);
+	return same;
+}
+
+static int cmp_dupfiles(const void *_a, const void *_b) {
+	const struct dupfile *a = *(struct dupfile* const*)_a, *b = *(struct dupfile* const*)_b;
+	int c = memcmp(&a->full, &b->full, sizeof(a->full));
+	return c != 0 ? c : strcmp(a->path, b->path);
+}
+
+static int cmp_groups(const void *_a, const void *_b) {
+	const struct sizegroup *a = *(struct sizegroup* const*)_a, *b = *(struct sizegroup* const*)_b;
+	return a->size < b->size ? 1 : a->size > b->size ? -1 : 0;
+}
+
+// Waits for the hashing to finish and prints every group of identical files, largest first, as size and path
+// lines with an empty line in front of each group, or nowhere if ob is NULL. Files with the same hash are
+// compared byte by byte with the first one before they count. Returns the bytes taken by copies beyond the
+// first of each.
+static uint64_t dup_report(struct outbuf *ob) {
+	pthread_mutex_lock(&duplock);
+	walkdone = true;
+	pthread_cond_broadcast(&dupcond);
+	pthread_mutex_unlock(&duplock);
+	for (long t = 0; t < nhashers; t++) {
+		if (pthread_join(hashers[t], NULL) != 0) {
+			perror("Failed to join thread");
+			exit(1);
+		}
+	}
+	free(hashers);
+	free(jobs);
+
+	size_t n = 0;
+	for (size_t i = 0; i < capgroups; i++) {
+		if (groups[i] != NULL) groups[n++] = groups[i];
+	}
+	qsort(groups, n, sizeof(struct sizegroup*), cmp_groups);
+	uint64_t wasted = 0;
+	struct dupfile **files = NULL;
+	size_t capfiles = 0;
+	unsigned char *buf = malloc(HASHBUF_SIZE);
+	if (buf == NULL) {
+		fprintf(stderr, "Buffer allocation failed\n");
+		exit(65);
+	}
+	for (size_t i = 0; i < n; i++) {
+		struct sizegroup *g = groups[i];
+		size_t nfiles = 0;
+		if (g->n > capfiles) {
+			capfiles = g->n;
+			free(files);
+			if ((files = malloc(capfiles * sizeof(struct dupfile*))) == NULL) {
+				fprintf(stderr, "Allocation failed\n");
+				exit(65);
+			}
+		}
+		for (struct dupfile *f = g->files; f != NULL; f = f->next) {
+			if (f->fulldone && !f->failed) files[nfiles++] = f;
+		}
+		qsort(files, nfiles, sizeof(struct dupfile*), cmp_dupfiles);
+		for (size_t a = 0, end; a < nfiles; a = end) {
+			for (end = a + 1; end < nfiles && memcmp(&files[a]->full, &files[end]->full, sizeof(files[a]->full)) == 0; end++);
+			// Files equal to the first one are moved up to b, the rest are checked again among themselves
+			size_t b = a + 1;
+			for (size_t k = a + 1; k < end; k++) {
+				if (!same_content(files[a], files[k], g->size, buf)) continue;
+				struct dupfile *tmp = files[b];
+				files[b++] = files[k];
+				files[k] = tmp;
+			}
+			if (b < end) qsort(files + b, end - b, sizeof(struct dupfile*), cmp_dupfiles);
+			end = b;
+			if (b - a < 2) continue;
+			wasted += (uint64_t)g->size * (b - a - 1);
+			if (ob == NULL) continue;
+			ob_putc(ob, '\n');
+			for (size_t k = a; k < b; k++) {
+				ob_puti(ob, g->size);
+				ob_putc(ob, '\t');
+				ob_puts(ob, files[k]->path);
+				ob_putc(ob, '\n');
+			}
+		}
+		for (struct dupfile *f = g->files, *next; f != NULL; f = next) {
+			next = f->next;
+			free(f->path);
+			free(f);
+		}
+		free(g->heads);
+		free(g);
+	}
+	free(files);
+	free(buf);
+	free(groups);
+	free(dupinodes.slots);
+	return wasted;
+}
+
+// Queues the entry of the directory being scanned, w->path ends with it. If it's entered without having been
+// stat()ed (unchecked), it may turn out to be unreadable, which is fine.
+static void enter_dir(struct walker *w, struct dirwork *item, int fd, const char *name, const struct stat *sb) {
+	bool unchecked = sb == NULL;
+	if (item->depth + 1 >= filter.maxdepth) return;
+	struct dirwork sub = { .fd = -1, .depth = item->depth + 1, .dev = item->dev, .devid = item->devid, .gated = item->gated };
+	if (sb != NULL && sb->st_dev != item->devid) set_device(&sub, sb->st_dev, w->path.data); // a mount point
+	const struct mountpoint *m;
+	if (unchecked && devgating && (m = find_mount(w->path.data)) != NULL && m->dev != item->devid) set_device(&sub, m->dev, w->path.data);
+	bool keep = __atomic_add_fetch(&openfds, 1, __ATOMIC_RELAXED) <= fdbudget
+		|| w->path.len >= PATH_MAX; // couldn't be reopened by path, so it stays open over the budget
+	if (keep || unchecked) {
+		sub.fd = openat(fd, name, O_RDONLY | O_DIRECTORY | (follow ? 0 : O_NOFOLLOW) | O_CLOEXEC);
+		if (sub.fd == -1 && unchecked && errno == EACCES) {
+			__atomic_sub_fetch(&openfds, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (sub.fd == -1) {
+			perror("Could not open directory");
+			exit(1);
+		}
+	}
+	if (!keep) {
+		__atomic_sub_fetch(&openfds, 1, __ATOMIC_RELAXED);
+		if (sub.fd != -1) close(sub.fd); // just checked, reopened by path when its turn comes
+		sub.fd = -1;
+	}
+	sub.path = strdup(w->path.data);
+	if (sub.path == NULL) {
+		fprintf(stderr, "String allocation failed\n");
+		exit(65);
+	}
+	push_work(w, sub);
+}
+
+// Prints an entry of the directory being scanned if it's to be shown and passes the filters, and queues it if
+// it's a directory to recurse into. sb is NULL if it couldn't be stat()ed.
+static void handle_entry(struct walker *w, struct dirwork *item, int fd, const char *name, const struct stat *sb, bool show) {
+	if (sb != NULL && !first_visit(sb)) return;
+	ss_push(&w->path, name);
+	if (sb == NULL) {
+		add_record(w, w->path.len);
+		ob_putfailed(&w->out, w->path.data);
+		w->stats.n_fail++;
+	} else if (show && filter_stat(sb)) {
+		add_record(w, w->path.len);
+		report(&w->stats, &w->ext, &w->out, w->path.data, sb);
+		if (nhashers > 0 && S_ISREG(sb->st_mode)) dup_add(w->path.data, sb);
+	}
+	if (sb != NULL && can_enter(sb)) enter_dir(w, item, fd, name, sb);
+	char *popped = ss_pop(&w->path);
+	assert(popped != NULL);
+}
+
+// -u: statx() calls of a directory's entries are queued on an io_uring of the walker thread, up to ringdepth
+// at once, and entries are handled in whatever order their results come back. On network filesystems the
+// round trips overlap instead of adding up. Set up with the raw syscalls, without liburing.
+struct ring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqmapsize, cqmapsize, sqessize;
+	// Per request slot, the slot number is the user_data of the request
+	struct statx *stx;
+	const char **names;   // point into the getdents64() buffer, all requests finish before it is reused
+	unsigned char *types;
+	bool *show;
+	unsigned *freeslots;
+	unsigned nfree, nslots;
+};
+
+static bool ring_init(struct ring *r, unsigned depth) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	r->fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (r->fd == -1) return false;
+	r->sqmapsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	r->cqmapsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && r->cqmapsize > r->sqmapsize) r->sqmapsize = r->cqmapsize;
+	r->sqmap = mmap(NULL, r->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cqmap = single ? r->sqmap : mmap(NULL, r->cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqmap == MAP_FAILED || r->cqmap == MAP_FAILED || r->sqes == MAP_FAILED) {
+		perror("Failed to map io_uring");
+		exit(1);
+	}
+	r->sqhead = (unsigned*)((char*)r->sqmap + params.sq_off.head);
+	r->sqtail = (unsigned*)((char*)r->sqmap + params.sq_off.tail);
+	r->sqmask = (unsigned*)((char*)r->sqmap + params.sq_off.ring_mask);
+	r->sqarray = (unsigned*)((char*)r->sqmap + params.sq_off.array);
+	r->cqhead = (unsigned*)((char*)r->cqmap + params.cq_off.head);
+	r->cqtail = (unsigned*)((char*)r->cqmap + params.cq_off.tail);
+	r->cqmask = (unsigned*)((char*)r->cqmap + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cqmap + params.cq_off.cqes);
+
+	if (depth > params.sq_entries) depth = params.sq_entries;
+	r->stx = malloc(depth * sizeof(struct statx));
+	r->names = malloc(depth * sizeof(const char*));
+	r->types = malloc(depth);
+	r->show = malloc(depth * sizeof(bool));
+	r->freeslots = malloc(depth * sizeof(unsigned));
+	if (r->stx == NULL || r->names == NULL || r->types == NULL || r->show == NULL || r->freeslots == NULL) {
+		fprintf(stderr, "Ring allocation failed\n");
+		exit(65);
+	}
+	for (r->nfree = 0; r->nfree < depth; r->nfree++) r->freeslots[r->nfree] = depth - 1 - r->nfree;
+	r->nslots = depth;
+	return true;
+}
+
+static void ring_free(struct ring *r) {
+	munmap(r->sqes, r->sqessize);
+	if (r->cqmap != r->sqmap) munmap(r->cqmap, r->cqmapsize);
+	munmap(r->sqmap, r->sqmapsize);
+	close(r->fd);
+	free(r->stx);
+	free(r->names);
+	free(r->types);
+	free(r->show);
+	free(r->freeslots);
+}
+
+// Submits everything queued, and waits until at least one request is done if wait is set
+static void ring_enter(struct ring *r, bool wait) {
+	unsigned tosubmit = *r->sqtail - __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+	if (tosubmit == 0 && !wait) return;
+	if (syscall(__NR_io_uring_enter, r->fd, tosubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1
+			&& errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		perror("io_uring_enter failed");
+		exit(1);
+	}
+}
+
+static void ring_statx(struct ring *r, int dirfd, const char *name, unsigned char type, bool show) {
+	unsigned slot = r->freeslots[--r->nfree];
+	r->names[slot] = name;
+	r->types[slot] = type;
+	r->show[slot] = show;
+	unsigned tail = *r->sqtail, idx = tail & *r->sqmask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)name;
+	sqe->len = statx_mask(type);
+	sqe->off = (uintptr_t)&r->stx[slot];
+	sqe->statx_flags = (follow ? 0 : AT_SYMLINK_NOFOLLOW) | AT_NO_AUTOMOUNT;
+	sqe->user_data = slot;
+	r->sqarray[idx] = idx;
+	__atomic_store_n(r->sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Handles all finished requests
+static void ring_reap(struct walker *w, struct dirwork *item, int fd) {
+	struct ring *r = w->ring;
+	unsigned head = *r->cqhead;
+	while (head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cqmask];
+		unsigned slot = cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(r->cqhead, ++head, __ATOMIC_RELEASE);
+		struct stat sb;
+		if (res == -EINVAL || res == -EOPNOTSUPP || (follow && (res == -ENOENT || res == -ELOOP))) {
+			// Kernel too old for IORING_OP_STATX, do it synchronously, or a dangling link
+			res = stat_at(fd, r->names[slot], r->types[slot], &sb) == 0 ? 0 : -errno;
+		} else if (res == 0) {
+			statx_to_stat(&r->stx[slot], &sb);
+		}
+		handle_entry(w, item, fd, r->names[slot], res == 0 ? &sb : NULL, r->show[slot]);
+		r->freeslots[r->nfree++] = slot;
+	}
+}
+
+static void scan_dir(struct walker *w, struct dirwork *item) {
+	int fd = item->fd;
+	if (fd == -1) fd = open(item->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	else __atomic_sub_fetch(&openfds, 1, __ATOMIC_RELAXED);
+	if (fd == -1) {
+		perror("Could not open directory");
+		exit(1);
+	}
+	if (w->dirbuf == NULL && (w->dirbuf = malloc(DIRBUF_SIZE)) == NULL) {
+		fprintf(stderr, "Directory buffer allocation failed\n");
+		exit(65);
+	}
+	if (ringdepth > 0 && w->ring == NULL && !w->noring) {
+		w->ring = malloc(sizeof(struct ring));
+		if (w->ring == NULL) {
+			fprintf(stderr, "Ring allocation failed\n");
+			exit(65);
+		}
+		if (!ring_init(w->ring, ringdepth)) {
+			if (!__atomic_exchange_n(&ringfailed, true, __ATOMIC_RELAXED)) perror("Failed to set up io_uring, using plain statx()");
+			free(w->ring);
+			w->ring = NULL;
+			w->noring = true;
+		}
+	}
+	struct ring *r = w->ring;
+	ss_assign(&w->path, item->path);
+	ssize_t nbuf;
+	// Read straight into a big buffer, without the small one readdir() would use
+	while ((nbuf = getdents64(fd, w->dirbuf, DIRBUF_SIZE)) > 0) {
+		for (ssize_t off = 0; off < nbuf; ) {
+			struct dirent64 *ent = (struct dirent64*)(w->dirbuf + off);
+			off += ent->d_reclen;
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+				continue; // Ignore . and .. entries
+			}
+			if (follow && ent->d_type == DT_LNK) ent->d_type = DT_UNKNOWN; // could be anything
+			int what = filter_entry(ent->d_name, ent->d_type, item->depth + 1);
+			if (what == F_SKIP) continue;
+			if (what == F_WALK && ent->d_type == DT_DIR && !follow) { // with -L it has to be checked against the visited ones
+				ss_push(&w->path, ent->d_name);
+				enter_dir(w, item, fd, ent->d_name, NULL);
+				char *popped = ss_pop(&w->path);
+				assert(popped != NULL);
+				continue;
+			}
+			if (r == NULL) {
+				struct stat sb;
+				bool ok = stat_at(fd, ent->d_name, ent->d_type, &sb) == 0;
+				handle_entry(w, item, fd, ent->d_name, ok ? &sb : NULL, what == F_SHOW);
+				continue;
+			}
+			while (r->nfree == 0) {
+				ring_enter(r, true);
+				ring_reap(w, item, fd);
+			}
+			ring_statx(r, fd, ent->d_name, ent->d_type, what == F_SHOW);
+		}
+		// The names point into the buffer, finish them before reading more
+		while (r != NULL && r->nfree < r->nslots) {
+			ring_enter(r, true);
+			ring_reap(w, item, fd);
+		}
+	}
+	if (nbuf == -1) {
+		perror("Failed to read directory");
+		fprintf(stderr, "%s\n", item->path);
+		w->stats.n_fail++;
+	}
+	if (close(fd) != 0) {
+		perror("Failed to close directory");
+		exit(1);
+	}
+	free(item->path);
+	if (!sorted && w->out.len >= OUTBUF_FLUSH) flush_walker(w);
+}
+
+static void* walker_main(void *arg) {
+	struct walker *w = arg;
+	struct dirwork item;
+	while (get_work(w, &item)) {
+		if (item.gated && !dev_acquire(&item)) continue;
+		unsigned dev = item.dev;
+		bool gated = item.gated;
+		scan_dir(w, &item);
+		if (gated) dev_release(w, dev);
+		if (__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST) == 0) {
+			pthread_mutex_lock(&idlelock);
+			pthread_cond_broadcast(&idlecond);
+			pthread_mutex_unlock(&idlelock);
+		}
+	}
+	if (!sorted) flush_walker(w);
+	return NULL;
+}
+
+// Orders paths the way a depth-first walk visiting names in byte order would print them:
+// a directory is followed by everything inside it, so '/' sorts before any other byte
+static int cmp_records(const void *_a, const void *_b) {
+	const struct record *a = _a, *b = _b;
+	size_t n = a->pathlen < b->pathlen ? a->pathlen : b->pathlen;
+	for (size_t i = 0; i < n; i++) {
+		unsigned char ca = a->line[i], cb = b->line[i];
+		if (ca != cb) {
+			if (ca == '/') return -1;
+			if (cb == '/') return 1;
+			return ca - cb;
+		}
+	}
+	return (a->pathlen > b->pathlen) - (a->pathlen < b->pathlen);
+}
+
+static void print_sorted(void) {
+	size_t n = 0;
+	for (long t = 0; t < nwalkers; t++) n += walkers[t].nrecords;
+	struct record *all = malloc((n + 1) * sizeof(struct record));
+	if (all == NULL) {
+		fprintf(stderr, "Record allocation failed\n");
+		exit(65);
+	}
+	n = 0;
+	for (long t = 0; t < nwalkers; t++) {
+		struct walker *w = &walkers[t];
+		for (size_t i = 0; i < w->nrecords; i++) {
+			all[n] = w->records[i];
+			all[n].line = w->out.data + w->records[i].off;
+			all[n].len = (i + 1 < w->nrecords ? w->records[i + 1].off : w->out.len) - w->records[i].off;
+			n++;
+		}
+	}
+	qsort(all, n, sizeof(struct record), cmp_records);
+	for (size_t i = 0; i < n; i++) {
+		ob_putn(&out, all[i].line, all[i].len);
+		if (out.len >= OUTBUF_FLUSH) ob_flush(&out);
+	}
+	free(all);
+}
+
+static void ext_merge(struct extstats *acc, struct extstats *e) {
+	for (int k = 0; k < SIZE_BUCKETS; k++) acc->sizes[k] += e->sizes[k];
+	for (size_t i = 0; i < e->cap; i++) {
+		if (e->slots[i] != NULL) ext_count(acc, e->slots[i]->name, e->slots[i]->len, e->slots[i]->files, e->slots[i]->bytes);
+	}
+	free(e->slots);
+	arena_free(&e->arena);
+}
+
+static void top_merge(struct topk *acc, struct topk *t) {
+	for (size_t i = 0; i < t->n; i++) {
+		if (acc->n == (size_t)topcount && !top_less(&acc->e[0], t->e[i].key, t->e[i].path)) free(t->e[i].path);
+		else top_insert(acc, t->e[i].key, t->e[i].path, &t->e[i].sb);
+	}
+	free(t->e);
+}
+
+static void add_stats(struct stats *acc, const struct stats *st) {
+	acc->n_file += st->n_file;
+	acc->n_dir += st->n_dir;
+	acc->n_char += st->n_char;
+	acc->n_blk += st->n_blk;
+	acc->n_fifo += st->n_fifo;
+	acc->n_sym += st->n_sym;
+	acc->n_sock += st->n_sock;
+	acc->n_fail += st->n_fail;
+	acc->total_bytes += st->total_bytes;
+}
+
+static struct columns *col_alloc(void) {
+	struct columns *c = calloc(1, sizeof(struct columns));
+	if (c == NULL) {
+		fprintf(stderr, "Column allocation failed\n");
+		exit(65);
+	}
+	return c;
+}
+
+static void col_free(struct columns *c) {
+	free(c->mode);
+	free(c->nlink);
+	free(c->size);
+	free(c->atime);
+	free(c->mtime);
+	free(c->paths.data);
+	free(c->restarts);
+	free(c->prev);
+	free(c);
+}
+
+// Writes the parts one after another as one listing
+static void col_write(const char *file, struct columns **parts, size_t nparts) {
+	struct libdircol_header hdr = { .magic = LIBDIRCOL_MAGIC };
+	for (size_t p = 0; p < nparts; p++) {
+		hdr.count += parts[p]->count;
+		hdr.nrestarts += parts[p]->nrestarts;
+		hdr.paths_size += parts[p]->paths.len;
+	}
+#define ALIGN8(x) (((x) + 7) / 8 * 8)
+	hdr.mode_off = ALIGN8(sizeof(hdr));
+	hdr.nlink_off = hdr.mode_off + ALIGN8(hdr.count * sizeof(uint32_t));
+	hdr.size_off = hdr.nlink_off + hdr.count * sizeof(uint64_t);
+	hdr.atime_off = hdr.size_off + hdr.count * sizeof(int64_t);
+	hdr.mtime_off = hdr.atime_off + hdr.count * sizeof(int64_t);
+	hdr.restarts_off = hdr.mtime_off + hdr.count * sizeof(int64_t);
+	hdr.paths_off = hdr.restarts_off + hdr.nrestarts * sizeof(struct libdircol_restart);
+#undef ALIGN8
+
+	FILE *f = fopen(file, "w");
+	if (f == NULL) {
+		perror("Could not open binary output file");
+		exit(1);
+	}
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+	for (size_t p = 0; p < nparts; p++) ok = ok && fwrite(parts[p]->mode, sizeof(uint32_t), parts[p]->count, f) == parts[p]->count;
+	if (hdr.count % 2 != 0) ok = ok && fwrite("\0\0\0", 1, 4, f) == 4; // keep the next column aligned
+	for (size_t p = 0; p < nparts; p++) ok = ok && fwrite(parts[p]->nlink, sizeof(uint64_t), parts[p]->count, f) == parts[p]->count;
+	for (size_t p = 0; p < nparts; p++) ok = ok && fwrite(parts[p]->size, sizeof(int64_t), parts[p]->count, f) == parts[p]->count;
+	for (size_t p = 0; p < nparts; p++) ok = ok && fwrite(parts[p]->atime, sizeof(int64_t), parts[p]->count, f) == parts[p]->count;
+	for (size_t p = 0; p < nparts; p++) ok = ok && fwrite(parts[p]->mtime, sizeof(int64_t), parts[p]->count, f) == parts[p]->count;
+	uint64_t base = 0, pathbase = 0;
+	for (size_t p = 0; p < nparts; p++) {
+		for (size_t r = 0; r < parts[p]->nrestarts; r++) {
+			struct libdircol_restart rs = { .index = parts[p]->restarts[r].index + base, .offset = parts[p]->restarts[r].offset + pathbase };
+			ok = ok && fwrite(&rs, sizeof(rs), 1, f) == 1;
+		}
+		base += parts[p]->count;
+		pathbase += parts[p]->paths.len;
+	}
+	for (size_t p = 0; p < nparts; p++) ok = ok && fwrite(parts[p]->paths.data, 1, parts[p]->paths.len, f) == parts[p]->paths.len;
+	if (fclose(f) != 0 || !ok) {
+		perror("Failed to write binary output");
+		exit(1);
+	}
+}
+
+static void walk_parallel(char **paths, int npaths) {
+	uid = geteuid();
+	gid = getegid();
+	struct rlimit rl;
+	if (maxfds > 0) {
+		fdbudget = maxfds;
+	} else {
+		fdbudget = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (long)rl.rlim_cur / 2 : 512;
+		fdbudget -= 2 * nwalkers; // each thread also has the directory it reads and its ring open
+	}
+
+	for (int c = 0; c < DEV_CLASSES; c++) {
+		if (class_limit(c) < nwalkers) devgating = true;
+	}
+	load_mounts();
+
+	walkers = calloc(nwalkers, sizeof(struct walker));
+	if (walkers == NULL) {
+		fprintf(stderr, "Walker allocation failed\n");
+		exit(65);
+	}
+	if (nhashers > 0) dup_start();
+	for (long t = 0; t < nwalkers; t++) {
+		pthread_mutex_init(&walkers[t].lock, NULL);
+		if (colfile != NULL) walkers[t].out.cols = col_alloc();
+		if (topcount > 0) {
+			walkers[t].out.top = calloc(1, sizeof(struct topk));
+			if (walkers[t].out.top == NULL) {
+				fprintf(stderr, "Top entry allocation failed\n");
+				exit(65);
+			}
+		}
+	}
+
+	// Roots are handled like the serial walker does it
+	struct walker *w = &walkers[0];
+	for (int i = 0; i < npaths; i++) {
+		const char *path = paths[i];
+		struct stat sb;
+		ss_assign(&w->path, path);
+		if (lstat(path, &sb) < 0) {
+			add_record(w, w->path.len);
+			ob_putfailed(&w->out, path);
+			w->stats.n_fail++;
+			continue;
+		}
+		if (!first_visit(&sb)) continue; // -L: inside an earlier root
+		if (filter_entry(strrchr(path, '/') + 1, DT_UNKNOWN, 0) == F_SHOW && filter_stat(&sb)) {
+			add_record(w, w->path.len);
+			report(&w->stats, &w->ext, &w->out, path, &sb);
+		}
+		if (can_enter(&sb) && filter.maxdepth > 0) {
+			struct dirwork root = { .path = strdup(path), .fd = -1, .depth = 0 };
+			if (root.path == NULL) {
+				fprintf(stderr, "String allocation failed\n");
+				exit(65);
+			}
+			set_device(&root, sb.st_dev, path);
+			push_work(w, root);
+		}
+	}
+
+	for (long t = 1; t < nwalkers; t++) {
+		if (pthread_create(&walkers[t].tid, NULL, walker_main, &walkers[t]) != 0) {
+			perror("Failed to create thread");
+			exit(1);
+		}
+	}
+	walker_main(w);
+	for (long t = 1; t < nwalkers; t++) {
+		if (pthread_join(walkers[t].tid, NULL) != 0) {
+			perror("Failed to join thread");
+			exit(1);
+		}
+	}
+
+	if (sorted) print_sorted();
+	if (nhashers > 0) dupbytes = dup_report(extended == EXT_JSON ? NULL : &out);
+	if (colfile != NULL) {
+		struct columns **parts = malloc(nwalkers * sizeof(struct columns*));
+		if (parts == NULL) {
+			fprintf(stderr, "Column allocation failed\n");
+			exit(65);
+		}
+		for (long t = 0; t < nwalkers; t++) parts[t] = walkers[t].out.cols;
+		col_write(colfile, parts, nwalkers);
+		for (long t = 0; t < nwalkers; t++) col_free(parts[t]);
+		free(parts);
+	}
+	for (long t = 0; t < nwalkers; t++) {
+		add_stats(&stats, &walkers[t].stats);
+		if (extended) ext_merge(&ext, &walkers[t].ext);
+		if (topcount > 0) {
+			top_merge(&top, walkers[t].out.top);
+			free(walkers[t].out.top);
+		}
+		free(walkers[t].out.data);
+		free(walkers[t].records);
+		free(walkers[t].dirbuf);
+		if (walkers[t].ring != NULL) {
+			ring_free(walkers[t].ring);
+			free(walkers[t].ring);
+		}
+		free(walkers[t].items);
+		if (walkers[t].path.data != NULL) ss_free(&walkers[t].path);
+		pthread_mutex_destroy(&walkers[t].lock);
+	}
+	free(walkers);
+	free_devices();
+	free_mounts();
+}
+
+// Incremental rescans (-S). The snapshot file holds the tree as it was at the last run: for every walked
+// directory its mtime and ctime, its entries with the stat() fields that get printed, sorted by name, and the
+// totals of its non-directory entries. A directory whose mtime and ctime are unchanged still has the same
+// entries, so it isn't read again: its entries and totals come from the snapshot, only its subdirectories are
+// stat()ed to check them in turn. Writes to files in unchanged directories don't touch the directory and
+// aren't noticed until something else changes it.
+// The file is a dump of the structs below in native byte order, entries in depth-first order, every walked
+// directory right after its entry.
+#define SNAP_MAGIC "DIRSNAP\1"
+
+struct snapdir;
+
+struct snapentry {
+	char *name;          // full path for the root
+	uint32_t mode, uid, gid;
+	uint64_t nlink, size;
+	int64_t atime, mtime;
+	struct snapdir *dir; // contents, for directories that were walked
+};
+
+struct snapdir {
+	int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+	struct stats own;           // non-directory entries, directories are counted as they are checked
+	size_t nentries;
+	struct snapentry *entries;
+};
+
+// On-disk records
+struct snaprec {
+	uint32_t namelen, mode, uid, gid;
+	uint64_t nlink, size;
+	int64_t atime, mtime;
+	uint32_t hasdir, pad;
+};
+
+struct snapdirrec {
+	int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+	struct stats own;
+	uint64_t nentries;
+};
+
+static bool snaplist; // no snapshot to compare with, print the usual listing
+static char *snapbuf; // getdents64() buffer, names are copied out before recursing
+
+static void snap_fromstat(struct snapentry *e, const struct stat *sb) {
+	e->mode = sb->st_mode;
+	e->uid = sb->st_uid;
+	e->gid = sb->st_gid;
+	e->nlink = sb->st_nlink;
+	e->size = sb->st_size;
+	e->atime = sb->st_atime;
+	e->mtime = sb->st_mtime;
+}
+
+static void snap_tostat(const struct snapentry *e, struct stat *sb) {
+	sb->st_mode = e->mode;
+	sb->st_uid = e->uid;
+	sb->st_gid = e->gid;
+	sb->st_nlink = e->nlink;
+	sb->st_size = e->size;
+	sb->st_atime = e->atime;
+	sb->st_mtime = e->mtime;
+}
+
+// Access times change by merely reading, they don't count as a change
+static bool snap_changed(const struct snapentry *e, const struct stat *sb) {
+	return e->mode != sb->st_mode || e->nlink != sb->st_nlink || e->size != (uint64_t)sb->st_size || e->mtime != sb->st_mtime
+		|| e->uid != sb->st_uid || e->gid != sb->st_gid;
+}
+
+static void snap_freedir(struct snapdir *d) {
+	if (d == NULL) return;
+	for (size_t i = 0; i < d->nentries; i++) {
+		free(d->entries[i].name);
+		snap_freedir(d->entries[i].dir);
+	}
+	free(d->entries);
+	free(d);
+}
+
+// Diff line: '+' added, '-' removed, 'M' changed, followed by the usual line
+static void snap_diff(char what, const char *fpath, const struct stat *sb) {
+	ob_putc(&out, what);
+	ob_putc(&out, '\t');
+	put_line(&out, fpath, sb);
+	if (out.len >= OUTBUF_FLUSH) ob_flush(&out);
+}
+
+static void snap_removed(struct sizedstr *path, const struct snapdir *d) {
+	if (d == NULL) return;
+	for (size_t i = 0; i < d->nentries; i++) {
+		struct stat sb;
+		snap_tostat(&d->entries[i], &sb);
+		ss_push(path, d->entries[i].name);
+		snap_diff('-', path->data, &sb);
+		snap_removed(path, d->entries[i].dir);
+		char *popped = ss_pop(path);
+		assert(popped != NULL);
+	}
+}
+
+static int cmp_snapentries(const void *_a, const void *_b) {
+	return strcmp(((const struct snapentry*)_a)->name, ((const struct snapentry*)_b)->name);
+}
+
+static struct snapdir* snap_scan(int *fd, struct sizedstr *path, struct snapdir *old, const struct stat *sb, unsigned depth);
+
+// Entry e of the directory open as *fd, whose stat() is dirsb, has just been stat()ed into sb, path ends with
+// its name. Walks it if it's a directory to recurse into, old is its previous contents. Like the serial walker,
+// only the deepest maxfds levels stay open: deeper than that, *fd is closed meanwhile and reopened through ".."
+// of the entry, or by path if that's no longer the same directory.
+static void snap_enter(int *fd, struct sizedstr *path, struct snapentry *e, struct snapdir *old, const struct stat *sb,
+		const struct stat *dirsb, unsigned depth) {
+	e->dir = NULL;
+	if (can_enter(sb)) {
+		int subfd = openat(*fd, e->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (subfd == -1) {
+			perror("Could not open directory");
+			exit(1);
+		}
+		bool reopen = depth + 1 >= (unsigned long)maxfds;
+		if (reopen) close(*fd);
+		e->dir = snap_scan(&subfd, path, old, sb, depth + 1);
+		if (reopen) {
+			struct level up = { .dev = dirsb->st_dev, .ino = dirsb->st_ino };
+			*fd = open_level(subfd, "..", &up);
+			if (*fd == -1) { // moved meanwhile, try the path instead
+				char *slash = path->data + path->len - strlen(e->name) - 1;
+				*slash = '\0';
+				*fd = open_level(AT_FDCWD, path->data, &up);
+				*slash = '/';
+			}
+			if (*fd == -1) {
+				perror("Could not reopen directory");
+				exit(1);
+			}
+		}
+		close(subfd);
+	}
+	if (e->dir == NULL && !snaplist) snap_removed(path, old); // not walked anymore
+	snap_freedir(old);
+}
+
+// Lists the directory open as fd again, the entries are returned sorted by name
+static struct snapentry* snap_read(int fd, struct sizedstr *path, size_t *nentries) {
+	size_t n = 0, cap = 16;
+	struct snapentry *entries = malloc(cap * sizeof(struct snapentry));
+	ssize_t nbuf;
+	if (entries == NULL) {
+		fprintf(stderr, "Snapshot allocation failed\n");
+		exit(65);
+	}
+	while ((nbuf = getdents64(fd, snapbuf, DIRBUF_SIZE)) > 0) {
+		for (ssize_t off = 0; off < nbuf; ) {
+			struct dirent64 *ent = (struct dirent64*)(snapbuf + off);
+			off += ent->d_reclen;
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) {
+				continue; // Ignore . and .. entries
+			}
+			if (n == cap) entries = realloc(entries, (cap *= 2) * sizeof(struct snapentry));
+			if (entries == NULL || (entries[n].name = strdup(ent->d_name)) == NULL) {
+				fprintf(stderr, "Snapshot allocation failed\n");
+				exit(65);
+			}
+			entries[n++].dir = NULL;
+		}
+	}
+	if (nbuf == -1) {
+		perror("Failed to read directory");
+		fprintf(stderr, "%s\n", path->data);
+		stats.n_fail++;
+	}
+	qsort(entries, n, sizeof(struct snapentry), cmp_snapentries);
+	*nentries = n;
+	return entries;
+}
+
+// Walks the directory open as fd, whose full path is in path and whose stat() is sb. old are its
+// contents from the snapshot, NULL if it wasn't walked before; its entries are taken over.
+static struct snapdir* snap_scan(int *fd, struct sizedstr *path, struct snapdir *old, const struct stat *sb, unsigned depth) {
+	struct snapdir *d = calloc(1, sizeof(struct snapdir));
+	if (d == NULL) {
+		fprintf(stderr, "Snapshot allocation failed\n");
+		exit(65);
+	}
+	d->mtime_sec = sb->st_mtim.tv_sec;
+	d->mtime_nsec = sb->st_mtim.tv_nsec;
+	d->ctime_sec = sb->st_ctim.tv_sec;
+	d->ctime_nsec = sb->st_ctim.tv_nsec;
+	bool unchanged = old != NULL && old->mtime_sec == d->mtime_sec && old->mtime_nsec == d->mtime_nsec
+		&& old->ctime_sec == d->ctime_sec && old->ctime_nsec == d->ctime_nsec;
+	if (unchanged) {
+		d->own = old->own;
+		d->nentries = old->nentries;
+		d->entries = old->entries;
+		old->nentries = 0;
+		old->entries = NULL;
+	} else {
+		d->entries = snap_read(*fd, path, &d->nentries);
+	}
+	add_stats(&stats, &d->own);
+
+	size_t j = 0; // next entry of old, when the directory changed
+	for (size_t i = 0; i < d->nentries; i++) {
+		struct snapentry *e = &d->entries[i];
+		if (unchanged && !S_ISDIR(e->mode)) continue; // counted in d->own
+		struct snapentry *prev = NULL;
+		struct snapdir *prevdir = NULL;
+		if (unchanged) {
+			prev = e;
+			prevdir = e->dir;
+		} else if (old != NULL) {
+			for (; j < old->nentries && strcmp(old->entries[j].name, e->name) < 0; j++) {
+				struct stat osb;
+				snap_tostat(&old->entries[j], &osb);
+				ss_push(path, old->entries[j].name);
+				snap_diff('-', path->data, &osb);
+				snap_removed(path, old->entries[j].dir);
+				char *popped = ss_pop(path);
+				assert(popped != NULL);
+			}
+			if (j < old->nentries && strcmp(old->entries[j].name, e->name) == 0) {
+				prev = &old->entries[j++];
+				prevdir = prev->dir;
+				prev->dir = NULL;
+			}
+		}
+
+		ss_push(path, e->name);
+		struct stat esb;
+		if (fstatat(*fd, e->name, &esb, AT_SYMLINK_NOFOLLOW) < 0) { // Usually fails due to file getting deleted since
+			ob_putfailed(&out, path->data);
+			stats.n_fail++;
+			e->mode = 0; // not saved
+			snap_freedir(prevdir);
+		} else {
+			bool known = count_entry(&stats, path->data, &esb);
+			if (known && !S_ISDIR(esb.st_mode)) count_entry(&d->own, path->data, &esb);
+			if (!known) {
+				e->mode = 0;
+			} else if (snaplist) {
+				put_line(&out, path->data, &esb);
+				if (out.len >= OUTBUF_FLUSH) ob_flush(&out);
+			} else if (prev == NULL) {
+				snap_diff('+', path->data, &esb);
+			} else if (snap_changed(prev, &esb)) {
+				snap_diff('M', path->data, &esb);
+			}
+			snap_fromstat(e, &esb);
+			snap_enter(fd, path, e, prevdir, &esb, sb, depth);
+		}
+		char *popped = ss_pop(path);
+		assert(popped != NULL);
+	}
+	for (; old != NULL && !unchanged && j < old->nentries; j++) {
+		struct stat osb;
+		snap_tostat(&old->entries[j], &osb);
+		ss_push(path, old->entries[j].name);
+		snap_diff('-', path->data, &osb);
+		snap_removed(path, old->entries[j].dir);
+		char *popped = ss_pop(path);
+		assert(popped != NULL);
+	}
+	return d;
+}
+
+static bool snap_write_entry(FILE *f, const struct snapentry *e) {
+	struct snaprec rec = { .namelen = strlen(e->name), .mode = e->mode, .uid = e->uid, .gid = e->gid, .nlink = e->nlink,
+		.size = e->size, .atime = e->atime, .mtime = e->mtime, .hasdir = e->dir != NULL };
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 || fwrite(e->name, 1, rec.namelen, f) != rec.namelen) return false;
+	if (e->dir == NULL) return true;
+	const struct snapdir *d = e->dir;
+	struct snapdirrec drec = { .mtime_sec = d->mtime_sec, .mtime_nsec = d->mtime_nsec, .ctime_sec = d->ctime_sec,
+		.ctime_nsec = d->ctime_nsec, .own = d->own, .nentries = 0 };
+	for (size_t i = 0; i < d->nentries; i++) drec.nentries += d->entries[i].mode != 0; // failed ones aren't saved
+	if (fwrite(&drec, sizeof(drec), 1, f) != 1) return false;
+	for (size_t i = 0; i < d->nentries; i++) {
+		if (d->entries[i].mode != 0 && !snap_write_entry(f, &d->entries[i])) return false;
+	}
+	return true;
+}
+
+// Written to a temporary file first, so an interrupted run leaves the old snapshot intact
+static void snap_save(const char *file, const struct snapentry *root) {
+	size_t len = strlen(file);
+	char *tmp = malloc(len + 5);
+	if (tmp == NULL) {
+		fprintf(stderr, "String allocation failed\n");
+		exit(65);
+	}
+	sprintf(tmp, "%s.tmp", file);
+	FILE *f = fopen(tmp, "w");
+	bool ok = f != NULL && fwrite(SNAP_MAGIC, 8, 1, f) == 1 && snap_write_entry(f, root);
+	if (f != NULL && fclose(f) != 0) ok = false;
+	if (!ok || rename(tmp, file) != 0) {
+		perror("Failed to write snapshot");
+		unlink(tmp);
+		stats.n_fail++;
+	}
+	free(tmp);
+}
+
+static bool snap_read_entry(FILE *f, struct snapentry *e) {
+	struct snaprec rec;
+	e->name = NULL;
+	e->dir = NULL;
+	if (fread(&rec, sizeof(rec), 1, f) != 1 || rec.namelen > PATH_MAX) return false;
+	if ((e->name = malloc(rec.namelen + 1)) == NULL || fread(e->name, 1, rec.namelen, f) != rec.namelen) return false;
+	e->name[rec.namelen] = '\0';
+	e->mode = rec.mode;
+	e->uid = rec.uid;
+	e->gid = rec.gid;
+	e->nlink = rec.nlink;
+	e->size = rec.size;
+	e->atime = rec.atime;
+	e->mtime = rec.mtime;
+	if (!rec.hasdir) return true;
+	struct snapdirrec drec;
+	if (fread(&drec, sizeof(drec), 1, f) != 1 || (e->dir = calloc(1, sizeof(struct snapdir))) == NULL) return false;
+	struct snapdir *d = e->dir;
+	d->mtime_sec = drec.mtime_sec;
+	d->mtime_nsec = drec.mtime_nsec;
+	d->ctime_sec = drec.ctime_sec;
+	d->ctime_nsec = drec.ctime_nsec;
+	d->own = drec.own;
+	// Grown while reading, a corrupt count doesn't get allocated up front
+	for (size_t cap = 0; d->nentries < drec.nentries; d->nentries++) {
+		if (d->nentries == cap) {
+			cap = cap ? cap * 2 : 16;
+			struct snapentry *entries = realloc(d->entries, cap * sizeof(struct snapentry));
+			if (entries == NULL) return false;
+			d->entries = entries;
+		}
+		if (!snap_read_entry(f, &d->entries[d->nentries])) {
+			d->nentries++; // free what was read of it
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the root entry of the snapshot, NULL if there is none or it is of another directory
+static struct snapentry* snap_load(const char *file, const char *path) {
+	FILE *f = fopen(file, "r");
+	if (f == NULL) {
+		if (errno != ENOENT) perror("Failed to open snapshot");
+		return NULL;
+	}
+	char magic[8];
+	struct snapentry *root = calloc(1, sizeof(struct snapentry));
+	if (root == NULL) {
+		fprintf(stderr, "Snapshot allocation failed\n");
+		exit(65);
+	}
+	bool ok = fread(magic, 8, 1, f) == 1 && memcmp(magic, SNAP_MAGIC, 8) == 0 && snap_read_entry(f, root);
+	fclose(f);
+	if (ok && strcmp(root->name, path) != 0) {
+		fprintf(stderr, "Snapshot %s is of %s, starting over\n", file, root->name);
+		ok = false;
+	} else if (!ok) {
+		fprintf(stderr, "Snapshot %s is damaged, starting over\n", file);
+	}
+	if (!ok) {
+		free(root->name);
+		snap_freedir(root->dir);
+		free(root);
+		return NULL;
+	}
+	return root;
+}
+
+static void walk_snapshot(const char *path, const char *file) {
+	uid = geteuid();
+	gid = getegid();
+	if ((snapbuf = malloc(DIRBUF_SIZE)) == NULL) {
+		fprintf(stderr, "Directory buffer allocation failed\n");
+		exit(65);
+	}
+	struct snapentry *old = snap_load(file, path);
+	snaplist = old == NULL;
+
+	struct snapentry root = { .name = strdup(path) };
+	struct stat sb;
+	ss_assign(&fullpath, path);
+	if (lstat(path, &sb) < 0) {
+		ob_putfailed(&out, path);
+		stats.n_fail++;
+		if (old != NULL) snap_removed(&fullpath, old->dir);
+	} else if (count_entry(&stats, path, &sb)) {
+		if (snaplist) put_line(&out, path, &sb);
+		else if (snap_changed(old, &sb)) snap_diff('M', path, &sb);
+		snap_fromstat(&root, &sb);
+		struct snapdir *olddir = old != NULL ? old->dir : NULL;
+		if (old != NULL) old->dir = NULL;
+		if (can_enter(&sb)) {
+			if (maxfds == 0) {
+				struct rlimit rl;
+				maxfds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ? (long)rl.rlim_cur / 2 : 512;
+			}
+			int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (fd == -1) {
+				perror("Could not open search directory");
+				exit(1);
+			}
+			root.dir = snap_scan(&fd, &fullpath, olddir, &sb, 0);
+			close(fd);
+			snap_freedir(olddir);
+		} else if (olddir != NULL) {
+			snap_removed(&fullpath, olddir);
+			snap_freedir(olddir);
+		}
+		snap_save(file, &root);
+	}
+	if (old != NULL) {
+		free(old->name);
+		free(old);
+	}
+	free(root.name);
+	snap_freedir(root.dir);
+	ss_free(&fullpath);
+	free(snapbuf);
+}
+#endif
+
+int main(int argc, char** argv) {
+#ifdef NFTW
+	int opt;
+	char *endptr;
+	while ((opt = getopt(argc, argv, "Le:T:k:")) != -1) {
+		switch (opt) {
+			case 'L': follow = true; break;
+			case 'e': extended = parse_extended(optarg); if (extended == EXT_NONE) argc = 0; break;
+			case 'T':
+				topcount = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || topcount <= 0) argc = 0;
+				break;
+			case 'k': topkey = parse_topkey(optarg); if (topkey < 0) argc = 0; break;
+			default: argc = 0; break;
+		}
+	}
+	if (argc - optind < 1 || (topcount > 0 && extended == EXT_JSON)) {
+		printf("Usage: %s [-L] [-T <count> [-k size|mtime|atime]] [-e text|json] <dir path>...\n", argc > 0 ? argv[0] : PROGNAME);
+		printf("  -L  follow symbolic links, every directory is still walked once\n");
+		printf("  -T  instead of the listing, print only this many entries ranking highest by -k, directories left out\n");
+		printf("  -k  what -T ranks by: size (the default), mtime or atime, newest first\n");
+		printf("  -e  add size histograms and per-extension totals to the summary as text, or print them as JSON\n");
+		printf("      instead of the listing and the summary\n");
+		exit(2);
+	}
+#else
+	int opt;
+	char *endptr;
+	long depth;
+	const char *snapfile = NULL;
+	nwalkers = 0;
+	while ((opt = getopt(argc, argv, "Lj:su:S:b:f:d:t:n:z:m:D:H:c:e:T:k:")) != -1) {
+		switch (opt) {
+			case 'j':
+				nwalkers = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || nwalkers <= 0) argc = 0; // print usage
+				break;
+			case 's': sorted = true; break;
+			case 'L': follow = true; break;
+			case 'u':
+				depth = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || depth <= 0 || depth > 4096) argc = 0;
+				else ringdepth = depth;
+				break;
+			case 'S': snapfile = optarg; break;
+			case 'b': colfile = optarg; break;
+			case 't': filter.on = true; if (!parse_types(optarg)) argc = 0; break;
+			case 'n': filter.on = true; filter.glob = optarg; break;
+			case 'z': filter.on = true; if (!parse_size(optarg)) argc = 0; break;
+			case 'm': filter.on = true; if (!parse_mtime(optarg)) argc = 0; break;
+			case 'D': filter.on = true; if (!parse_depth(optarg)) argc = 0; break;
+			case 'c': if (!parse_limits(optarg)) argc = 0; break;
+			case 'e': extended = parse_extended(optarg); if (extended == EXT_NONE) argc = 0; break;
+			case 'T':
+				topcount = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || topcount <= 0) argc = 0;
+				break;
+			case 'k': topkey = parse_topkey(optarg); if (topkey < 0) argc = 0; break;
+			case 'H':
+				nhashers = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || nhashers <= 0) argc = 0;
+				break;
+			case 'd':
+				dutop = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || dutop <= 0) argc = 0;
+				break;
+			case 'f':
+				maxfds = strtol(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || maxfds <= 0) argc = 0;
+				break;
+			default: argc = 0; break;
+		}
+	}
+	if (argc - optind < 1 || ((snapfile != NULL || dutop > 0) && argc - optind != 1) || (snapfile != NULL && (follow || nwalkers > 0 || sorted || ringdepth > 0 || colfile != NULL)) || (sorted && colfile != NULL)
+			|| (dutop > 0 && (snapfile != NULL || nwalkers > 0 || sorted || ringdepth > 0 || colfile != NULL))
+			|| ((filter.on || nhashers > 0 || extended || topcount > 0) && (snapfile != NULL || dutop > 0))
+			|| (topcount > 0 && (sorted || colfile != NULL || extended == EXT_JSON))) {
+		printf("Usage: %s [-L] [-j <threads>] [-c <limits>] [-s] [-u <depth>] [-f <fds>] [-H <threads>] [-T <count> [-k <key>]] [-e text|json] [<filters>] <dir path>...\n", argc > 0 ? argv[0] : PROGNAME);
+		printf("       %s [-L] [-j <threads>] [-c <limits>] [-u <depth>] [-f <fds>] [-H <threads>] [-e text|json] [<filters>] -b <output file> <dir path>...\n", argc > 0 ? argv[0] : PROGNAME);
+		printf("       %s -S <snapshot> [-f <fds>] <dir path>\n", argc > 0 ? argv[0] : PROGNAME);
+		printf("       %s -d <count> [-L] [-f <fds>] <dir path>\n", argc > 0 ? argv[0] : PROGNAME);
+		printf("  -L  follow symbolic links, every directory is still walked once\n");
+		printf("  -j  walk with this many threads using getdents64() and statx(), entries of different directories come out interleaved\n");
+		printf("  -c  class=N,... how many threads may read directories of one device at once, for the classes ssd\n");
+		printf("      (and anything local that isn't a rotational disk), hdd and net; by default hdd=1, others unlimited;\n");
+		printf("      filesystems with no block device of their own, like overlay and tmpfs, count as ssd\n");
+		printf("  -s  sort the output, the same for any number of threads\n");
+		printf("  -u  stat directory entries through io_uring, with up to this many requests in flight per thread\n");
+		printf("  -f  keep at most this many directories open, the ones above get closed and reopened when the walk\n");
+		printf("      returns to them; by default half of the open file limit\n");
+		printf("  -b  write the listing to a binary columnar file instead, readable with libdircol\n");
+		printf("  -H  find duplicate files with this many hashing threads while walking, print them at the end\n");
+		printf("  -T  instead of the listing, print only this many entries ranking highest by -k, directories left out\n");
+		printf("  -k  what -T ranks by: size (the default), mtime or atime, newest first\n");
+		printf("  -e  add size histograms and per-extension totals to the summary as text, or print them as JSON\n");
+		printf("      instead of the listing and the summary\n");
+		printf("  -d  instead of the listing, print disk usage of the heaviest directories, hard links counted once\n");
+		printf("  -S  compare with the snapshot from the last run and print changes, rereading only changed directories;\n");
+		printf("      without a snapshot, walk everything sorted; the snapshot is updated afterwards\n");
+		printf("Filters, only matching entries are printed and counted:\n");
+		printf("  -t  type, any of the letters fdlspcb as in find -type\n");
+		printf("  -n  name matching the shell pattern\n");
+		printf("  -z  size [+-]N[kMGT], bigger than, smaller than or exactly N bytes\n");
+		printf("  -m  mtime [+-]N, modified more than, less than or exactly N days ago\n");
+		printf("  -D  depth N, N:, :M or N:M, the root is 0\n");
+		exit(2);
+	}
+#endif
+	if (topcount > 0) out.top = &top;
+	int npaths = argc - optind;
+	char **paths = malloc(npaths * sizeof(char*));
+	if (paths == NULL) {
+		perror("Could not allocate paths");
+		exit(1);
+	}
+	for (int i = 0; i < npaths; i++) {
+		paths[i] = realpath(argv[optind + i], NULL);
+		if (paths[i] == NULL) {
+			perror("Could not obtain realpath");
+			exit(1);
+		}
+	}
+#ifdef NFTW
+	for (int i = 0; i < npaths; i++) walk(paths[i]);
+#else
+	if (snapfile != NULL) {
+		walk_snapshot(paths[0], snapfile);
+	} else if (nwalkers > 0 || sorted || ringdepth > 0 || filter.on || nhashers > 0) { // filters need d_type from getdents64()
+		if (nwalkers == 0) nwalkers = 1;
+		walk_parallel(paths, npaths);
+	} else {
+		if (colfile != NULL) out.cols = col_alloc();
+		for (int i = 0; i < npaths; i++) walk(paths[i]); // one after another
+		if (colfile != NULL) {
+			col_write(colfile, &out.cols, 1);
+			col_free(out.cols);
+			out.cols = NULL;
+		}
+	}
+#endif
+	for (int i = 0; i < npaths; i++) free(paths[i]);
+	free(paths);
+	if (topcount > 0) {
+		out.top = NULL;
+		top_print(&top);
+	}
+	ob_flush(&out);
+
+	if (extended == EXT_JSON) {
+#ifdef NFTW
+		ext_print(&stats, &ext, extended, NULL);
+#else
+		ext_print(&stats, &ext, extended, nhashers > 0 ? &dupbytes : NULL);
+#endif
+	} else {
+		printf("Files:      %u\n", stats.n_file);
+		printf("Dirs:       %u\n", stats.n_dir);
+		printf("Char devs:  %u\n", stats.n_char);
+		printf("Block devs: %u\n", stats.n_blk);
+		printf("FIFOs:      %u\n", stats.n_fifo);
+		printf("Symlinks:   %u\n", stats.n_sym);
+		printf("Sockets:    %u\n", stats.n_sock);
+		printf("\n");
+		printf("Bytes total: %lu\n", stats.total_bytes);
+#ifndef NFTW
+		if (dutop > 0) printf("Disk usage:  %lu\n", dublocks * 512);
+		if (nhashers > 0) printf("Duplicates:  %lu\n", dupbytes);
+#endif
+		if (extended) ext_print(&stats, &ext, extended, NULL);
 	}
-	walk(path);
-	free(path);
-
-	printf("Files:      %u\n", stats.n_file);
-	printf("Dirs:       %u\n", stats.n_dir);
-	printf("Char devs:  %u\n", stats.n_char);
-	printf("Block devs: %u\n", stats.n_blk);
-	printf("FIFOs:      %u\n", stats.n_fifo);
-	printf("Symlinks:   %u\n", stats.n_sym);
-	printf("Sockets:    %u\n", stats.n_sock);
-	printf("\n");
-	printf("Bytes total: %lu\n", stats.total_bytes);
 
 	if (stats.n_fail > 0) {
 		fprintf(stderr, "Failed to read %u files total\n", stats.n_fail);
@@ -0,0 +1,16 @@
+// Mateusz Naściszewski, 2022
+// Child started by main with -s vfork, posix_spawn or clone3, says hello like a forked one does.
+// Without arguments (benchmark) it just exits. Linked statically, so exec doesn't have to load anything.
+#include <stdio.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    if (argc < 2) return 0;
+    char buf[48];
+    int written = snprintf(buf, sizeof(buf), "Hello from child %.10s (pid %d)\n", argv[1], getpid());
+    if (write(STDOUT_FILENO, buf, written) == -1) {
+        perror("Child write failed");
+        return 1;
+    }
+    return 0;
+}
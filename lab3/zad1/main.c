@@ -1,26 +1,132 @@
 // Mateusz Naściszewski, 2022
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> // PATH_MAX
+#include <time.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <signal.h> // SIGCHLD
 #include <sys/wait.h>
+#include <sys/resource.h> // getrusage
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/syscall.h>
+#include <linux/sched.h> // struct clone_args
 
-int main(int argc, char** argv) {
-    if (argc != 2 || *argv[1] == '\0') {
-        printf("Usage: %s <num forks>\n", argc > 0 ? argv[0] : "main");
-        exit(2);
+extern char **environ;
+
+// How children are started (-s). With fork they run child_main() in a copy of the parent, unless -x is given,
+// the others can only exec, so they run the helper program instead, which says the same hello.
+enum strategy { S_FORK, S_VFORK, S_POSIX_SPAWN, S_CLONE3, NSTRATEGIES };
+static const char *const strategy_names[NSTRATEGIES] = { "fork", "vfork", "posix_spawn", "clone3" };
+
+static char helper[PATH_MAX]; // "child" next to this program
+static bool forkexec;         // -x
+static long maxinflight;      // -p, 0 to spawn everything first and wait() afterwards
+
+// Child of fork, quiet in the benchmark
+static void child_main(int i, bool quiet) {
+    if (quiet) _exit(0);
+    char buf[48];
+    int written = sprintf(buf, "Hello from child %d (pid %d)\n", i + 1, getpid());
+    if (write(STDOUT_FILENO, buf, written) == -1) {
+        perror("Child write failed");
+        exit(1);
     }
+    exit(0);
+}
 
-    char *endptr = NULL;
-    long forks = strtol(argv[1], &endptr, 10);
-    if (*endptr != '\0' || forks <= 0) {
-        fprintf(stderr, "Failed to parse argument\n");
-        exit(2);
+// clone3() with CLONE_VM | CLONE_VFORK, the child runs on the parent's stack while the parent waits. It must
+// not touch that stack, not even by returning from syscall(), so the call and the child's execve() are done
+// in one piece of assembly. Only written for x86-64. If pidfd isn't NULL, a pidfd of the child is stored there.
+static pid_t clone3_exec(const char *path, char *const argv[], char *const envp[], int *pidfd) {
+#ifdef __x86_64__
+    struct clone_args args = { .flags = CLONE_VM | CLONE_VFORK, .exit_signal = SIGCHLD };
+    if (pidfd != NULL) {
+        args.flags |= CLONE_PIDFD;
+        args.pidfd = (uintptr_t)pidfd;
     }
+    register const char *r8 __asm__("r8") = path; // syscalls leave these alone
+    register char *const *r9 __asm__("r9") = argv;
+    register char *const *r10 __asm__("r10") = envp;
+    long ret;
+    __asm__ volatile(
+        "syscall\n\t"
+        "test %%rax, %%rax\n\t"
+        "jnz 1f\n\t"
+        "mov %[execve], %%eax\n\t" // child
+        "mov %%r8, %%rdi\n\t"
+        "mov %%r9, %%rsi\n\t"
+        "mov %%r10, %%rdx\n\t"
+        "syscall\n\t"
+        "mov %[exit], %%eax\n\t"
+        "mov $127, %%edi\n\t"
+        "syscall\n"
+        "1:"
+        : "=a"(ret)
+        : "a"((long)SYS_clone3), "D"(&args), "S"(sizeof(args)), "r"(r8), "r"(r9), "r"(r10),
+          [execve] "i"(SYS_execve), [exit] "i"(SYS_exit)
+        : "rcx", "r11", "memory");
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+#else
+    (void)path, (void)argv, (void)envp, (void)pidfd;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 
+// Starts child number i, returns its pid or -1 with errno set. With pidfd, a pidfd of the child is stored there.
+static pid_t spawn(enum strategy s, int i, bool quiet, int *pidfd) {
+    char num[16];
+    snprintf(num, sizeof(num), "%d", i + 1);
+    char *args[] = { helper, quiet ? NULL : num, NULL }; // ready before the child shares our memory
+    pid_t cpid = -1;
+    switch (s) {
+        case S_CLONE3:
+            return clone3_exec(helper, args, environ, pidfd); // gets its pidfd right away
+        case S_FORK:
+            cpid = fork();
+            if (cpid == 0 && forkexec) {
+                execve(helper, args, environ);
+                _exit(127);
+            }
+            if (cpid == 0) child_main(i, quiet);
+            break;
+        case S_VFORK:
+            cpid = vfork();
+            if (cpid == 0) {
+                execve(helper, args, environ);
+                _exit(127);
+            }
+            break;
+        default:
+            errno = posix_spawn(&cpid, helper, NULL, NULL, args, environ);
+            if (errno != 0) cpid = -1;
+            break;
+    }
+    if (cpid != -1 && pidfd != NULL && (*pidfd = pidfd_open(cpid, 0)) == -1) {
+        // Can't be waited for with the others, don't leave it behind
+        int err = errno;
+        waitpid(cpid, NULL, 0);
+        errno = err;
+        return -1;
+    }
+    return cpid;
+}
+
+// Starts the children, then waits for all of them. Returns false if something failed.
+static bool run(enum strategy s, long forks, bool quiet) {
     for (int i = 0; i < forks; i++) {
-        pid_t cpid = fork();
+        pid_t cpid = spawn(s, i, quiet, NULL);
         if (cpid == -1) {
-            perror("fork failed");
+            fprintf(stderr, "%s failed: %s\n", strategy_names[s], strerror(errno));
             for (int j = 0; j < i; j++) {
                 int status;
                 if (wait(&status) == -1) {
@@ -28,32 +134,195 @@ int main(int argc, char** argv) {
                     // ignore nested error, still try to wait to prevent zombies
                 }
             }
-            exit(1);
-        }
-        if (cpid == 0) {
-            // Child
-            char buf[48];
-            int written = sprintf(buf, "Hello from child %d (pid %d)\n", i + 1, getpid());
-            if (write(STDOUT_FILENO, buf, written) == -1) {
-                perror("Child write failed");
-                exit(1);
-            }
-            exit(0);
-        } else {
-            // Parent
-            // Do nothing, for now
+            return false;
         }
     }
 
-    int exitval = 0;
+    bool ok = true;
+    long failed = 0;
     for (int i = 0; i < forks; i++) {
         int status;
         if (wait(&status) == -1) {
             perror("Failed to wait() for child");
             // Don't exit, wait for the other children to prevent zombies
-            exitval = 1;
+            ok = false;
+        } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++; // 127 if the helper couldn't be run
+        }
+    }
+    if (failed > 0) fprintf(stderr, "%ld children failed, helper: %s\n", failed, helper);
+    return ok && failed == 0;
+}
+
+static int cmp_doubles(const void *_a, const void *_b) {
+    double a = *(const double*)_a, b = *(const double*)_b;
+    return a < b ? -1 : a > b;
+}
+
+static double since(const struct timespec *t0) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+// -p: every child gets a pidfd, which becomes readable when it exits, and all of them are watched by one epoll
+// instance. Spawning and reaping overlap, at most maxinflight children are alive at once: while there's room
+// exits are only picked up as they come, without waiting, otherwise the next batch is waited for.
+// How long each child took from being spawned to being reaped is printed at the end, unless quiet.
+static bool run_pidfd(enum strategy s, long forks, bool quiet) {
+    struct inflight {
+        int pidfd;
+        struct timespec start;
+    } *slots = malloc(maxinflight * sizeof(struct inflight));
+    int *freeslots = malloc(maxinflight * sizeof(int));
+    double *latency = malloc(forks * sizeof(double));
+    struct epoll_event events[64];
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (slots == NULL || freeslots == NULL || latency == NULL || ep == -1) {
+        perror("Failed to set up reaping");
+        exit(1);
+    }
+    for (long k = 0; k < maxinflight; k++) freeslots[k] = maxinflight - 1 - k;
+    long nfree = maxinflight, spawned = 0, reaped = 0, failed = 0;
+    bool ok = true;
+    while (reaped < spawned || (ok && spawned < forks)) {
+        bool room = ok && spawned < forks && nfree > 0;
+        if (room) {
+            int k = freeslots[--nfree];
+            clock_gettime(CLOCK_MONOTONIC, &slots[k].start);
+            if (spawn(s, spawned, quiet, &slots[k].pidfd) == -1) {
+                fprintf(stderr, "%s failed: %s\n", strategy_names[s], strerror(errno));
+                freeslots[nfree++] = k;
+                ok = false; // no more spawning, only reap the ones already running
+                continue;
+            }
+            struct epoll_event ev = { .events = EPOLLIN, .data.u32 = k };
+            if (epoll_ctl(ep, EPOLL_CTL_ADD, slots[k].pidfd, &ev) == -1) {
+                perror("Failed to watch child");
+                exit(1);
+            }
+            spawned++;
+        }
+        int n = epoll_wait(ep, events, sizeof(events) / sizeof(events[0]), room ? 0 : -1);
+        if (n == -1 && errno != EINTR) {
+            perror("Failed to wait for children");
+            exit(1);
+        }
+        for (int e = 0; e < n; e++) {
+            int k = events[e].data.u32;
+            siginfo_t info;
+            if (waitid(P_PIDFD, slots[k].pidfd, &info, WEXITED) == -1) {
+                perror("Failed to waitid() for child");
+                ok = false;
+            } else if (info.si_code != CLD_EXITED || info.si_status != 0) {
+                failed++; // 127 if the helper couldn't be run
+            }
+            latency[reaped++] = since(&slots[k].start);
+            // A child forked meanwhile may still hold a copy of it, which would keep it in the epoll set
+            if (epoll_ctl(ep, EPOLL_CTL_DEL, slots[k].pidfd, NULL) == -1) {
+                perror("Failed to stop watching child");
+                exit(1);
+            }
+            close(slots[k].pidfd);
+            freeslots[nfree++] = k;
+        }
+    }
+    close(ep);
+    if (failed > 0) fprintf(stderr, "%ld children failed, helper: %s\n", failed, helper);
+    if (!quiet && reaped > 0) {
+        qsort(latency, reaped, sizeof(double), cmp_doubles);
+        double sum = 0;
+        for (long k = 0; k < reaped; k++) sum += latency[k];
+        printf("Exit latency (us): min %.0f, median %.0f, mean %.0f, p99 %.0f, max %.0f\n", latency[0] * 1e6,
+                latency[reaped / 2] * 1e6, sum / reaped * 1e6, latency[(reaped - 1) * 99 / 100] * 1e6,
+                latency[reaped - 1] * 1e6);
+    }
+    free(slots);
+    free(freeslots);
+    free(latency);
+    return ok && failed == 0;
+}
+
+// -b: every strategy in turn, quiet children, fork both with and without exec. Minor page faults are what
+// fork() mostly costs, the parent's come from copy-on-write after it, the children's include setting up the
+// exec'ed helper.
+static bool benchmark(long forks) {
+    printf("strategy     spawns/s  parent faults/spawn  child faults/spawn\n");
+    bool ok = true;
+    for (int row = 0; row <= NSTRATEGIES; row++) {
+        enum strategy s = row == 0 ? S_FORK : row - 1; // fork twice
+        forkexec = row == 1;
+        const char *name = forkexec ? "fork+exec" : strategy_names[s];
+        struct rusage self0, children0, self1, children1;
+        struct timespec t0, t1;
+        getrusage(RUSAGE_SELF, &self0);
+        getrusage(RUSAGE_CHILDREN, &children0);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (!(maxinflight > 0 ? run_pidfd(s, forks, true) : run(s, forks, true))) {
+            ok = false;
+            continue;
         }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        getrusage(RUSAGE_SELF, &self1);
+        getrusage(RUSAGE_CHILDREN, &children1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("%-11s %9.0f  %19.2f  %18.2f\n", name, forks / secs,
+                (double)(self1.ru_minflt - self0.ru_minflt) / forks,
+                (double)(children1.ru_minflt - children0.ru_minflt) / forks);
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    enum strategy strategy = S_FORK;
+    bool bench = false;
+    char *endptr = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:xp:b")) != -1) {
+        switch (opt) {
+            case 's':
+                strategy = NSTRATEGIES;
+                for (int s = 0; s < NSTRATEGIES; s++) {
+                    if (strcmp(optarg, strategy_names[s]) == 0) strategy = s;
+                }
+                if (strategy == NSTRATEGIES) argc = 0; // print usage
+                break;
+            case 'x': forkexec = true; break;
+            case 'p':
+                maxinflight = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' || maxinflight <= 0) argc = 0;
+                break;
+            case 'b': bench = true; break;
+            default: argc = 0; break;
+        }
+    }
+    if (argc - optind != 1 || *argv[optind] == '\0') {
+        printf("Usage: %s [-s fork|vfork|posix_spawn|clone3] [-x] [-p <max children>] <num forks>\n", argc > 0 ? argv[0] : "main");
+        printf("       %s -b [-p <max children>] <num forks>\n", argc > 0 ? argv[0] : "main");
+        printf("  -s  how to start the children, all but fork exec the child helper; fork by default\n");
+        printf("  -x  exec the child helper with fork too\n");
+        printf("  -p  reap children through pidfds and epoll while spawning, with at most this many alive at once,\n");
+        printf("      and print how long they took from spawn to exit\n");
+        printf("  -b  start and reap that many quiet children with every strategy, print spawns per second\n");
+        printf("      and minor page faults per spawn\n");
+        exit(2);
+    }
+
+    long forks = strtol(argv[optind], &endptr, 10);
+    if (*endptr != '\0' || forks <= 0) {
+        fprintf(stderr, "Failed to parse argument\n");
+        exit(2);
+    }
+
+    // The helper is expected in the same directory
+    const char *slash = strrchr(argv[0], '/');
+    int dirlen = slash != NULL ? slash - argv[0] + 1 : 0;
+    if (snprintf(helper, sizeof(helper), "%.*schild", dirlen, argv[0]) >= (int)sizeof(helper)) {
+        fprintf(stderr, "Path too long\n");
+        exit(2);
     }
 
-    return exitval;
+    if (bench) return benchmark(forks) ? 0 : 1;
+    if (maxinflight > 0) return run_pidfd(strategy, forks, false) ? 0 : 1;
+    return run(strategy, forks, false) ? 0 : 1;
 }